@@ -0,0 +1,54 @@
+#include "lz11.h"
+
+// Runs from ITCM, since it gets called for nearly every frame
+ITCM_CODE void lz11Decompress(const uint8_t* src, void* dst, bool vram) {
+    uint32_t size = src[1] | (src[2] << 8) | (src[3] << 16);
+    uint8_t* out = (uint8_t*) dst;
+    uint32_t pos = 0;
+    uint16_t pending = 0;   // The lower byte of a halfword that hasn't been written to VRAM yet
+
+    src += 4;
+
+    while (pos < size) {
+        uint8_t flags = *src++;
+
+        for (int i = 0; i < 8 && pos < size; i++, flags <<= 1) {
+            uint32_t length;
+            uint32_t distance;
+
+            if (!(flags & 0x80)) {
+                length = 1;
+                distance = 0;
+            } else if ((src[0] >> 4) == 0) {
+                length = (((src[0] & 0xF) << 4) | (src[1] >> 4)) + 0x11;
+                distance = (((src[1] & 0xF) << 8) | src[2]) + 1;
+                src += 3;
+            } else if ((src[0] >> 4) == 1) {
+                length = (((src[0] & 0xF) << 12) | (src[1] << 4) | (src[2] >> 4)) + 0x111;
+                distance = (((src[2] & 0xF) << 8) | src[3]) + 1;
+                src += 4;
+            } else {
+                length = (src[0] >> 4) + 1;
+                distance = (((src[0] & 0xF) << 8) | src[1]) + 1;
+                src += 2;
+            }
+
+            if (length > size - pos) {
+                length = size - pos;
+            }
+
+            for (uint32_t j = 0; j < length; j++, pos++) {
+                uint8_t value = distance ? out[pos - distance] : *src++;
+
+                if (!vram) {
+                    out[pos] = value;
+                } else if (!(pos & 1)) {
+                    pending = value;
+                } else {
+                    // VRAM can't be written byte by byte. VRAM safe streams never reference the pending byte
+                    *(uint16_t*) &out[pos - 1] = pending | (value << 8);
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <nds.h>
+
+// Decompresses an LZ11 (type 0x11) stream. The BIOS can only do LZ77 (type 0x10), so this is done in software.
+// If vram is set, the output gets written 16 bits at a time, so it can go straight into VRAM
+void lz11Decompress(const uint8_t* src, void* dst, bool vram);
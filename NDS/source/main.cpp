@@ -2,43 +2,139 @@
 #include <fat.h>
 #include <cstdio>
 #include <string>
+#include <malloc.h>
 #include "NDSBG.h"
+#include "lz11.h"
 
 // The flags for telling what the next frame will be
 #define FLAG_COMPRESSION_STAY           1
 #define FLAG_COMPRESSION_CHARACTERS     (1 << 1)
 #define FLAG_COMPRESSION_LZ77           (1 << 2)
+#define FLAG_DURATION                   (1 << 3)    // A byte with the number of VBlanks the frame stays on screen follows
+#define FLAG_COMPRESSION_VRAM           (1 << 4)    // The LZ77 stream can be decompressed straight into VRAM
+#define FLAG_COMPRESSION_LZ11           (1 << 5)    // The frame uses LZ11 (type 0x11) instead of LZSS (type 0x10)
+#define FLAG_COMPRESSION_DICT           (1 << 6)    // The stream continues from the start of the previous frame buffer
+#define FLAG_EXTENDED                   (1 << 7)    // A byte with the extended flags below follows right after the flags
+
+// The extended flags
+#define EXT_FLAG_RESIDUAL               1           // The frame buffer has to be XORed with the previous one of the screen
+#define EXT_FLAG_SPLIT                  (1 << 1)    // The map bytes and the characters are stored as separate streams
+#define EXT_FLAG_BILEVEL                (1 << 2)    // Characters with only two values are packed into 1 bit per pixel
+#define EXT_FLAG_4BPP                   (1 << 3)    // The characters use 4 bits per pixel and a palette bank each
+#define EXT_FLAG_SCROLL                 (1 << 4)    // Two bytes with the BG scroll offset follow the extended flags
+#define EXT_FLAG_METATILE               (1 << 5)    // The map is stored as a map of 2x2 blocks of map entries
+#define EXT_FLAG_REFERENCE              (1 << 6)    // A STAY frame that shows the frame buffer of a reference slot again
+#define EXT_FLAG_KEEP                   (1 << 7)    // The frame buffer gets copied into a reference slot after decoding
+
+// The flags telling how the whole video is laid out
+#define VIDEO_FLAG_DUAL_SCREEN          1       // Every frame consists of a top and a bottom screen plane
+#define VIDEO_FLAG_SOLID_TILES          (1 << 1)    // The last characters of every BG buffer are a solid tile per brightness level
+#define VIDEO_FLAG_AUDIO_BLOCK_TYPES    (1 << 2)    // Every audio block starts with a byte that tells how it's stored
+#define VIDEO_FLAG_MONO                 (1 << 3)    // Every audio block is mono or silent, so both speakers can play the same buffer
+#define VIDEO_REFERENCE_SLOTS_SHIFT     8           // Bits 8-11 hold the number of reference slots of every screen
+#define VIDEO_AUDIO_BLOCK_SHIFT         16          // Bits 16-31 hold the number of samples per audio block, 0 means sampleSize
+
+// The ways an audio block can be stored
+#define AUDIO_BLOCK_PCM                 0           // The left channel followed by the right channel
+#define AUDIO_BLOCK_SILENCE             1           // Nothing follows, the whole block is silent
+#define AUDIO_BLOCK_MONO                2           // A single channel for both speakers
 
 // Used for storing the compressed data
-uint8_t vramBuffer[1024*64];
+alignas(4) uint8_t vramBuffer[1024*64];
 
 // All the audio stuff
 constexpr int audioBufferSize = 15;             // Used for telling many audio blocks we have in our buffer
-constexpr int sampleSize = 3200;                // How many points each audio block consists of
+constexpr int sampleSize = 3200;                // Most points an audio block can consist of (48000 Hz)
+int blockSamples = sampleSize;                  // How many points each audio block of the video consists of
 volatile uint8_t audioBlock = 0;                // Used to tell which audio blcok to write to/read from
+constexpr int ticksPerAudioBlock = 4;           // How many VBlanks each audio block lasts
+constexpr int preloadBlocks = 12;               // How many audio blocks are in front of the first frame
+int audioBlocksRead = 0;                        // Stores the amount of audio blocks read after the preloaded ones
 uint16_t audioL[sampleSize * audioBufferSize];  // Audio buffer for the left speaker
 uint16_t audioR[sampleSize * audioBufferSize];  // Audio buffer for the right speaker
 
 constexpr int queueSize = 8;                        // How many frame buffers are in the queue
 constexpr int frameBufferSize = 0xC000;             // Size of each frame buffer
-uint8_t frameBuffers[queueSize][frameBufferSize];   // Frame buffer queue
-volatile uint8_t drawQueue = 0;                     // Used for telling which frames to redraw and which frames stay the same
+constexpr int mapSize = 32 * 24;                    // Number of map entries at the start of each frame buffer
+constexpr int splitHeaderSize = 4;                  // Sizes of the two map streams in front of an EXT_FLAG_SPLIT frame
+constexpr int metatileMapSize = 16 * 12;            // Number of 2x2 blocks of map entries in an EXT_FLAG_METATILE frame
+constexpr int maxReferenceSlots = 8;                // Most frame buffers a screen can keep around to show them again later
+constexpr int solidTileBase = frameBufferSize / 64 - 32;    // First character of the solid tile bank
+constexpr int dictSize = 0x1000 - 0x12;             // How much of the previous frame buffer a FLAG_COMPRESSION_DICT frame can reach back into
+
+// The first level of every palette bank of 4bpp characters. Color 0 is transparent and shows the backdrop (level 0)
+constexpr int paletteBankStart(int bank) {
+    return bank == 0 ? 1 : (bank == 1 ? 17 : bank);
+}
+
+// Every frame buffer has room in front of it, so the dictionary can be put right before the frame that gets decompressed
+struct alignas(32) FrameBuffer {
+    uint8_t dictionary[0x1000];
+    uint8_t data[frameBufferSize];
+};
+FrameBuffer frameBuffers[queueSize];                // Frame buffer queue
+FrameBuffer frameBuffersSub[queueSize];             // Frame buffer queue for the bottom screen in dual screen mode
+FrameBuffer residualBuffer;                         // Used for frames that can't be decompressed straight into their frame buffer
+alignas(4) uint8_t mapPlanes[2][mapSize];           // The high and low bytes of the map of an EXT_FLAG_SPLIT frame
 
 volatile uint8_t curFrameBuffer = 1;    // Stores which frame buffer to write to
 volatile uint8_t drawFrame = 0;         // Stores which frame buffer to draw
 volatile uint8_t numFramesQueue = 1;    // Stores the amount of loaded frame buffers
+uint8_t frameDurations[queueSize] = {1, 1, 1, 1, 1, 1, 1, 1};  // Stores how many VBlanks each frame in the queue stays on screen
+volatile uint8_t ticksLeft = 0;         // Stores how many more VBlanks the current frame stays on screen
 
 volatile uint16_t* palette = (volatile uint16_t*) 0x05000000;   // The palette holding all 32 brightness levels
 
+volatile uint16_t* paletteSub = (volatile uint16_t*) 0x05000400;   // The same palette for the bottom screen
+
 // The places at which we'll store the images for top and bottom screen
 void* vramA = (void*) 0x06000000;
 void *vramC = (void*) 0x06204000;
+void* vramCTiles = (void*) 0x06200000;  // Bottom screen tile map in dual screen mode
+
+// Each screen has two BG buffers in VRAM, one at 0 and one at 48 KB. The second one gets used by frames that are
+// decompressed straight into VRAM, so they can be written while the other one is on screen
+constexpr int vramMapBase = frameBufferSize / 0x800;    // Map base of the second BG buffer
+constexpr int vramTileBase = frameBufferSize / 0x4000;  // Tile base of the second BG buffer
+
+// Everything needed to show the frames of one screen
+struct Screen {
+    int bg;                                         // The background id returned by bgInit
+    uint8_t* vram;                                  // The first BG buffer
+    FrameBuffer* frameBuffers;                      // The frame buffer queue of this screen
+    uint8_t dictionary[dictSize];                   // Start of the last frame buffer that got decompressed
+    uint8_t lastFrame;                              // The last frame buffer that got decompressed
+    volatile uint8_t queue4bpp;                     // Frames that use 4bpp characters
+    uint8_t scroll[queueSize][2];                   // BG scroll offset of every frame. The map of a scrolled frame has a 25th row
+    uint16_t copySizes[queueSize];                  // How much of every frame buffer gets copied into VRAM
+    int lastSize;                                   // Number of bytes in it, everything after that counts as 0
+    uint8_t dmaChannel;                             // The DMA channel used for copying frames into VRAM
+    volatile uint8_t drawQueue;                     // Used for telling which frames to redraw and which frames stay the same
+    volatile uint8_t vramQueue;                     // Frames that are still compressed and get decompressed straight into VRAM
+    volatile uint8_t lz11Queue;                     // Frames in vramQueue that use LZ11
+    volatile uint8_t shownBuffer;                   // The BG buffer that's on screen
+    volatile bool hiddenReady;                      // Set once a frame got decompressed into the BG buffer that isn't on screen
+    volatile uint8_t hiddenFrame;                   // The frame buffer that got decompressed into the hidden BG buffer
+    uint8_t decodeFrame;                            // The next frame buffer to check for frames that go straight into VRAM
+    uint8_t (*references)[frameBufferSize];         // Frames that can be shown again later, one per reference slot
+    int referenceSizes[maxReferenceSlots];          // Number of bytes in use in every reference slot
+    uint8_t reference4bpp;                          // Reference slots with 4bpp characters
+    uint8_t referenceScroll[maxReferenceSlots][2];  // BG scroll offset of every reference slot
+};
+
+Screen screens[2];
+int numScreens = 1;
 
 uint8_t flags;                      // Stores the flags of the upcoming frame
+uint8_t extFlags;                   // Stores the extended flags of the upcoming frame
 uint16_t blockLength;               // Stores the size of the upcoming frame
 volatile int frame = 0;             // Stores the amount of frames drawn
 volatile int framesRead = 0;        // Stores the amount of frames read
+volatile int ticksShown = 0;        // Stores the amount of VBlanks since the video started
+int ticksRead = 0;                  // Stores the VBlank at which the next frame that gets read will be shown
 int numFrames;                      // Stores the total number of frames in the video
+uint32_t videoFlags;                // Stores the video flags from the header
+int numReferenceSlots = 0;          // Stores the number of reference slots of every screen from the header
 volatile bool queueLoad = false;    // Used for stopping the next frame in case of a reading error
 
 FILE* videoFile;
@@ -46,15 +142,317 @@ FILE* videoFile;
 // Gets executed everytime a VBlank interrupt occurs (so exactly 60 times a second)
 void VBlankProc() {
     if (queueLoad) {
-        if (drawQueue & (1 << drawFrame)) {
-            // Loads the next frame from the queue into VRam
-            dmaCopyWordsAsynch(3, frameBuffers[drawFrame], vramA, frameBufferSize);
+        ticksShown++;
+        if (ticksLeft > 0) {
+            ticksLeft--;
+        }
+
+        // Switch to the next frame once the current one has been shown long enough
+        if (ticksLeft == 0 && numFramesQueue > 0) {
+            // A frame that hasn't been decompressed into VRAM yet stays in the queue until it has
+            for (int i = 0; i < numScreens; i++) {
+                Screen& screen = screens[i];
+                if ((screen.vramQueue & (1 << drawFrame)) && !(screen.hiddenReady && screen.hiddenFrame == drawFrame)) {
+                    return;
+                }
+            }
+
+            for (int i = 0; i < numScreens; i++) {
+                Screen& screen = screens[i];
+                if (screen.vramQueue & (1 << drawFrame)) {
+                    // The frame is already in VRAM, so just show the other BG buffer
+                    screen.shownBuffer ^= 1;
+                    bgSetMapBase(screen.bg, screen.shownBuffer * vramMapBase);
+                    bgSetTileBase(screen.bg, screen.shownBuffer * vramTileBase);
+                    screen.hiddenReady = false;
+                } else if (screen.drawQueue & (1 << drawFrame)) {
+                    // Loads the next frame from the queue into VRam. Every screen uses its own DMA channel, so both copies can run at the same time
+                    dmaCopyWordsAsynch(screen.dmaChannel, screen.frameBuffers[drawFrame].data, screen.vram + screen.shownBuffer * frameBufferSize, screen.copySizes[drawFrame]);
+                } else {
+                    continue;
+                }
+
+                // Every frame can switch between 4bpp and 8bpp characters and has its own scroll offset
+                if (screen.queue4bpp & (1 << drawFrame)) {
+                    bgClearControlBits(screen.bg, BG_COLOR_256);
+                } else {
+                    bgSetControlBits(screen.bg, BG_COLOR_256);
+                }
+                bgSetScroll(screen.bg, screen.scroll[drawFrame][0], screen.scroll[drawFrame][1]);
+            }
+            bgUpdate();
+            ticksLeft = frameDurations[drawFrame];
+            frame++;
+            numFramesQueue--;
+            drawFrame++;
+            drawFrame %= queueSize;
+            if (!(videoFlags & VIDEO_FLAG_DUAL_SCREEN)) {
+                printf("\x1b[1;1H%i of %i       ", frame, numFrames);
+            }
+        }
+    }
+}
+
+// Reads the next audio block into the audio buffer. Silent blocks are just a marker in the file, and mono blocks only
+// have the left channel. If the whole video is mono, both speakers play the left buffer
+void readAudioBlock() {
+    uint8_t type = AUDIO_BLOCK_PCM;
+    if (videoFlags & VIDEO_FLAG_AUDIO_BLOCK_TYPES) {
+        fread(&type, 1, 1, videoFile);
+    }
+
+    if (type == AUDIO_BLOCK_SILENCE) {
+        memset(&audioL[audioBlock * blockSamples], 0, blockSamples * 2);
+        if (!(videoFlags & VIDEO_FLAG_MONO)) {
+            memset(&audioR[audioBlock * blockSamples], 0, blockSamples * 2);
+        }
+    } else if (type == AUDIO_BLOCK_MONO) {
+        fread(&audioL[audioBlock * blockSamples], 1, blockSamples * 2, videoFile);
+        if (!(videoFlags & VIDEO_FLAG_MONO)) {
+            memcpy(&audioR[audioBlock * blockSamples], &audioL[audioBlock * blockSamples], blockSamples * 2);
+        }
+    } else {
+        fread(&audioL[audioBlock * blockSamples], 1, blockSamples * 2, videoFile);
+        fread(&audioR[audioBlock * blockSamples], 1, blockSamples * 2, videoFile);
+    }
+}
+
+// Turns a residual back into a frame buffer by XORing it with the previous frame buffer
+ITCM_CODE void applyResidual(uint32_t* dst, const uint32_t* residual, const uint32_t* last, int size, int lastSize) {
+    int i = 0;
+    for (; i < size / 4 && i < lastSize / 4; i++) {
+        dst[i] = residual[i] ^ last[i];
+    }
+    if (dst != residual) {
+        for (; i < size / 4; i++) {
+            dst[i] = residual[i];
+        }
+    }
+}
+
+// Decompresses an LZ77 or LZ11 stream into RAM, depending on the flags of the current frame. Returns the decompressed size
+int decompressStream(const uint8_t* src, uint8_t* dst) {
+    if (flags & FLAG_COMPRESSION_LZ11) {
+        lz11Decompress(src, dst, false);
+    } else {
+        decompress(src, dst, LZ77);
+    }
+
+    // The size is stored right after the type in the header of the stream
+    return src[1] | (src[2] << 8) | (src[3] << 16);
+}
+
+// Decompresses the map streams and the character stream of an EXT_FLAG_SPLIT frame and puts the map back together
+int decompressSplit(const uint8_t* src, uint8_t* dst) {
+    const uint8_t* stream = src + splitHeaderSize;
+    for (int i = 0; i < 2; i++) {
+        decompressStream(stream, mapPlanes[i]);
+        stream += src[i * 2] | (src[i * 2 + 1] << 8);
+    }
+    int rawSize = mapSize * 2 + decompressStream(stream, dst + mapSize * 2);
+
+    uint16_t* map = (uint16_t*) dst;
+    for (int i = 0; i < mapSize; i++) {
+        map[i] = mapPlanes[1][i] | (mapPlanes[0][i] << 8);
+    }
+    return rawSize;
+}
+
+// Unpacks the characters of an EXT_FLAG_BILEVEL frame. Returns the size of the unpacked frame buffer
+ITCM_CODE int expandBilevel(const uint8_t* src, uint8_t* dst) {
+    memcpy(dst, src, mapSize * 2);
+
+    int numTiles = src[mapSize * 2] | (src[mapSize * 2 + 1] << 8);
+    const uint8_t* classes = &src[mapSize * 2 + 2];
+    const uint8_t* tile = classes + (numTiles + 7) / 8;
+    uint8_t* out = dst + mapSize * 2;
+
+    for (int i = 0; i < numTiles; i++, out += 64) {
+        if (!(classes[i / 8] & (1 << (i % 8)))) {
+            memcpy(out, tile, 64);
+            tile += 64;
+            continue;
+        }
+
+        // Two values followed by a mask byte per row
+        for (int y = 0; y < 8; y++) {
+            uint8_t mask = tile[2 + y];
+            for (int x = 0; x < 8; x++) {
+                out[y * 8 + x] = tile[(mask >> x) & 1];
+            }
+        }
+        tile += 10;
+    }
+    return mapSize * 2 + numTiles * 64;
+}
+
+// Expands the metatile map of an EXT_FLAG_METATILE frame into a regular map, followed by the characters. Returns the size of the
+// expanded frame buffer
+ITCM_CODE int expandMetatiles(const uint8_t* src, uint8_t* dst, int rawSize) {
+    int numMetatiles = src[0] | (src[1] << 8);
+    const uint16_t* metatiles = (const uint16_t*) (src + 2);
+    const uint8_t* metatileMap = src + 2 + numMetatiles * 8;
+    uint16_t* map = (uint16_t*) dst;
+
+    for (int i = 0; i < metatileMapSize; i++) {
+        const uint16_t* metatile = &metatiles[metatileMap[i] * 4];
+        uint16_t* entry = &map[(i / 16) * 64 + (i % 16) * 2];
+        entry[0] = metatile[0];
+        entry[1] = metatile[1];
+        entry[32] = metatile[2];
+        entry[33] = metatile[3];
+    }
+
+    int charactersSize = rawSize - (metatileMap + metatileMapSize - src);
+    memcpy(dst + mapSize * 2, metatileMap + metatileMapSize, charactersSize);
+    return mapSize * 2 + charactersSize;
+}
+
+// Reads one plane of the next frame into the frame buffer queue of a screen. Returns false if the flag byte is invalid
+bool loadPlane(Screen& screen) {
+    uint8_t* frameBuffer = screen.frameBuffers[curFrameBuffer].data;
+
+    fread(&flags, 1, 1, videoFile);
+    extFlags = 0;
+    if (flags & FLAG_EXTENDED) {
+        fread(&extFlags, 1, 1, videoFile);
+    }
+    screen.scroll[curFrameBuffer][0] = 0;
+    screen.scroll[curFrameBuffer][1] = 0;
+    if (extFlags & EXT_FLAG_SCROLL) {
+        fread(screen.scroll[curFrameBuffer], 1, 2, videoFile);
+    }
+    uint8_t slot = 0;
+    if (extFlags & (EXT_FLAG_REFERENCE | EXT_FLAG_KEEP)) {
+        fread(&slot, 1, 1, videoFile);
+        if (slot >= numReferenceSlots) {
+            return false;
+        }
+    }
+    if (flags & FLAG_DURATION) {
+        fread(&frameDurations[curFrameBuffer], 1, 1, videoFile);
+    }
+
+    screen.vramQueue &= ~(1 << curFrameBuffer);
+    screen.lz11Queue &= ~(1 << curFrameBuffer);
+
+    if (flags & (FLAG_COMPRESSION_LZ77 | FLAG_COMPRESSION_CHARACTERS)) {
+        fread(&blockLength, 2, 1, videoFile);
+
+        // Draw the frame that got loaded
+        screen.drawQueue |= (1 << curFrameBuffer);
+
+        if ((flags & FLAG_COMPRESSION_VRAM) && !(flags & FLAG_COMPRESSION_DICT) && !extFlags && blockLength <= frameBufferSize) {
+            // Keep the frame compressed until the hidden BG buffer is free. That saves the copy and the cache flush
+            fread(frameBuffer, 1, blockLength, videoFile);
+            screen.vramQueue |= (1 << curFrameBuffer);
+            if (flags & FLAG_COMPRESSION_LZ11) {
+                screen.lz11Queue |= (1 << curFrameBuffer);
+            }
+        } else {
+            fread(vramBuffer, 1, blockLength, videoFile);
+
+            // After going around the queue once, the previous frame buffer is the one that gets replaced, so the residual has to go somewhere else.
+            // Packed and metatile frames get expanded into the frame buffer afterwards
+            uint8_t* lastBuffer = screen.frameBuffers[screen.lastFrame].data;
+            uint8_t* output = frameBuffer;
+            if (((extFlags & EXT_FLAG_RESIDUAL) && lastBuffer == frameBuffer) || (extFlags & (EXT_FLAG_BILEVEL | EXT_FLAG_METATILE))) {
+                output = residualBuffer.data;
+            }
+
+            // Both decompressors simply read matches from in front of the output, so that's where the dictionary goes
+            if (flags & FLAG_COMPRESSION_DICT) {
+                memcpy(output - dictSize, screen.dictionary, dictSize);
+            }
+
+            int rawSize;
+            if (extFlags & EXT_FLAG_SPLIT) {
+                rawSize = decompressSplit(vramBuffer, output);
+            } else {
+                rawSize = decompressStream(vramBuffer, output);
+            }
+            if (extFlags & EXT_FLAG_BILEVEL) {
+                rawSize = expandBilevel(output, frameBuffer);
+            }
+            if (extFlags & EXT_FLAG_METATILE) {
+                rawSize = expandMetatiles(output, frameBuffer, rawSize);
+            }
+
+            // Only the part of the frame buffer that's in use has to be copied into VRAM
+            screen.copySizes[curFrameBuffer] = (rawSize + 3) & ~3;
+            if (extFlags & EXT_FLAG_4BPP) {
+                screen.queue4bpp |= (1 << curFrameBuffer);
+            } else {
+                screen.queue4bpp &= ~(1 << curFrameBuffer);
+            }
+
+            if (extFlags & EXT_FLAG_RESIDUAL) {
+                applyResidual((uint32_t*) frameBuffer, (uint32_t*) output, (uint32_t*) lastBuffer, rawSize, screen.lastSize);
+            }
+            DC_FlushRange(frameBuffer, frameBufferSize);
+
+            memset(screen.dictionary, 0, dictSize);
+            memcpy(screen.dictionary, frameBuffer, rawSize < dictSize ? rawSize : dictSize);
+            screen.lastFrame = curFrameBuffer;
+            screen.lastSize = rawSize;
+
+            if (extFlags & EXT_FLAG_KEEP) {
+                memcpy(screen.references[slot], frameBuffer, rawSize);
+                screen.referenceSizes[slot] = rawSize;
+                screen.referenceScroll[slot][0] = screen.scroll[curFrameBuffer][0];
+                screen.referenceScroll[slot][1] = screen.scroll[curFrameBuffer][1];
+                if (extFlags & EXT_FLAG_4BPP) {
+                    screen.reference4bpp |= (1 << slot);
+                } else {
+                    screen.reference4bpp &= ~(1 << slot);
+                }
+            }
+        }
+    } else if ((flags & FLAG_COMPRESSION_STAY) && (extFlags & EXT_FLAG_REFERENCE)) {
+        // Show the frame from the reference slot again, just like it had been decompressed
+        int rawSize = screen.referenceSizes[slot];
+        memcpy(frameBuffer, screen.references[slot], rawSize);
+        DC_FlushRange(frameBuffer, frameBufferSize);
+
+        screen.drawQueue |= (1 << curFrameBuffer);
+        screen.copySizes[curFrameBuffer] = (rawSize + 3) & ~3;
+        screen.scroll[curFrameBuffer][0] = screen.referenceScroll[slot][0];
+        screen.scroll[curFrameBuffer][1] = screen.referenceScroll[slot][1];
+        if (screen.reference4bpp & (1 << slot)) {
+            screen.queue4bpp |= (1 << curFrameBuffer);
+        } else {
+            screen.queue4bpp &= ~(1 << curFrameBuffer);
+        }
+
+        memset(screen.dictionary, 0, dictSize);
+        memcpy(screen.dictionary, frameBuffer, rawSize < dictSize ? rawSize : dictSize);
+        screen.lastFrame = curFrameBuffer;
+        screen.lastSize = rawSize;
+    } else if (flags & FLAG_COMPRESSION_STAY) {
+        // Don't draw the loaded frame
+        screen.drawQueue &= ~(1 << curFrameBuffer);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Decompresses the next frame of the queue that goes straight into VRAM into the BG buffer that isn't on screen
+void decompressToVram(Screen& screen) {
+    while (!screen.hiddenReady && screen.decodeFrame != curFrameBuffer) {
+        uint8_t frameBuffer = screen.decodeFrame;
+        screen.decodeFrame = (screen.decodeFrame + 1) % queueSize;
+
+        if (screen.vramQueue & (1 << frameBuffer)) {
+            uint8_t* hiddenBuffer = screen.vram + (screen.shownBuffer ^ 1) * frameBufferSize;
+            if (screen.lz11Queue & (1 << frameBuffer)) {
+                lz11Decompress(screen.frameBuffers[frameBuffer].data, hiddenBuffer, true);
+            } else {
+                decompress(screen.frameBuffers[frameBuffer].data, hiddenBuffer, LZ77Vram);
+            }
+            screen.hiddenFrame = frameBuffer;
+            screen.hiddenReady = true;
         }
-        frame++;
-        numFramesQueue--;
-        drawFrame++;
-        drawFrame %= queueSize;
-        printf("\x1b[1;1H%i of %i       ", frame, numFrames);
     }
 }
 
@@ -87,35 +485,98 @@ int main()
         }
     }
 
-    // Read number of frames
+    // Read number of frames and the video flags
     fread(&numFrames, 4, 1, videoFile);
+    fread(&videoFlags, 4, 1, videoFile);
+
+    // Videos with a lower sample rate have shorter audio blocks
+    if (videoFlags >> VIDEO_AUDIO_BLOCK_SHIFT) {
+        blockSamples = videoFlags >> VIDEO_AUDIO_BLOCK_SHIFT;
+    }
+
+    bool dualScreen = videoFlags & VIDEO_FLAG_DUAL_SCREEN;
 
     // Set video modes
     videoSetMode(MODE_0_2D);
-    videoSetModeSub(MODE_3_2D);
     vramSetBankA(VRAM_A_MAIN_BG_0x06000000);
     vramSetBankC(VRAM_C_SUB_BG_0x06200000);
 
     // Initialize the backgrounds for the images
-    bgInit(0, BgType_Text8bpp, BgSize_T_256x256, 0, 0);
-    bgInitSub(3, BgType_Bmp16, BgSize_B16_256x256, 1, 0);
-
-    // Initialize the console for the bottom screen frame counter
-    consoleInit(nullptr, 0, BgType_Text4bpp, BgSize_T_256x256, 4, 0, false, true);
+    screens[0].bg = bgInit(0, BgType_Text8bpp, BgSize_T_256x256, 0, 0);
+    screens[0].vram = (uint8_t*) vramA;
+    screens[0].frameBuffers = frameBuffers;
+    screens[0].dmaChannel = 3;
 
     // Reset the top screen
     memset((void*) vramA, 0, 256*256*2);
 
-    // Set up the palette for the top screen
+    // Set up the palette for the top screen. The first 32 colors are used by 8bpp characters, and every palette bank of
+    // 4bpp characters covers 15 levels after the backdrop. The first two banks match the 8bpp colors
     for (int i = 0; i < 32; i++) {
         palette[i] = i | (i << 5) | ((i << 10)) | (1 << 15);
     }
+    for (int bank = 2; bank < 16; bank++) {
+        for (int i = 1; i < 16; i++) {
+            int level = paletteBankStart(bank) + i - 1;
+            palette[bank * 16 + i] = level | (level << 5) | (level << 10) | (1 << 15);
+        }
+    }
+
+    if (dualScreen) {
+        // The bottom screen shows the second plane exactly like the top screen, so there's no room for the frame counter
+        videoSetModeSub(MODE_0_2D);
+        screens[1].bg = bgInitSub(0, BgType_Text8bpp, BgSize_T_256x256, 0, 0);
+        screens[1].vram = (uint8_t*) vramCTiles;
+        screens[1].frameBuffers = frameBuffersSub;
+        screens[1].dmaChannel = 2;
+        numScreens = 2;
+        memset(vramCTiles, 0, 256*256*2);
+
+        for (int i = 0; i < 256; i++) {
+            paletteSub[i] = palette[i];
+        }
+    } else {
+        videoSetModeSub(MODE_3_2D);
+        bgInitSub(3, BgType_Bmp16, BgSize_B16_256x256, 1, 0);
+
+        // Initialize the console for the bottom screen frame counter
+        consoleInit(nullptr, 0, BgType_Text4bpp, BgSize_T_256x256, 4, 0, false, true);
+
+        // Set the console color
+        *(uint16_t*)0x50005fe = 0x7518;
+
+        // Display the background on the bottom screen
+        memcpy(vramC, NDSBGBitmap, NDSBGBitmapLen);
+    }
 
-    // Set the console color
-    *(uint16_t*)0x50005fe = 0x7518;
+    // Every reference slot takes up a whole frame buffer, so only as many as the video uses get allocated
+    numReferenceSlots = (videoFlags >> VIDEO_REFERENCE_SLOTS_SHIFT) & 0xF;
+    for (int i = 0; i < numScreens && numReferenceSlots; i++) {
+        if (numReferenceSlots <= maxReferenceSlots) {
+            screens[i].references = (uint8_t (*)[frameBufferSize]) memalign(32, numReferenceSlots * frameBufferSize);
+        }
+        if (!screens[i].references) {
+            consoleDemoInit();
+            printf("Not enough memory for %d reference slots", numReferenceSlots);
+            while (true) {
+                scanKeys();
+                if (keysDown() & KEY_START) break;
+            }
+            return 0;
+        }
+    }
 
-    // Display the background on the bottom screen
-    memcpy(vramC, NDSBGBitmap, NDSBGBitmapLen);
+    // Fill the solid tile bank of every BG buffer once. Frames stop right in front of it, so it never gets overwritten
+    if (videoFlags & VIDEO_FLAG_SOLID_TILES) {
+        for (int i = 0; i < numScreens; i++) {
+            for (int buffer = 0; buffer < 2; buffer++) {
+                uint16_t* bank = (uint16_t*) (screens[i].vram + buffer * frameBufferSize + solidTileBase * 64);
+                for (int j = 0; j < 32 * 32; j++) {
+                    bank[j] = (j / 32) | ((j / 32) << 8);
+                }
+            }
+        }
+    }
 
     // Set up the VBlankProc to execute everytime the NDS calls the VBlank interrupt
     irqSet(IRQ_VBLANK, VBlankProc);
@@ -127,9 +588,8 @@ int main()
     soundEnable();
 
     // Preload 12 audio blocks
-    for (int i = 0; i < 12; i++) {
-        fread(&audioL[audioBlock * sampleSize], 1, sampleSize * 2, videoFile);
-        fread(&audioR[audioBlock * sampleSize], 1, sampleSize * 2, videoFile);
+    for (int i = 0; i < preloadBlocks; i++) {
+        readAudioBlock();
         audioBlock++;
     }
 
@@ -143,55 +603,60 @@ int main()
     // Main loop
     while(true)
     {
-        // Wait until we're able to load a new frame
-        while (numFramesQueue >= queueSize || ((curFrameBuffer + 1) % queueSize) == drawFrame);
+        // Wait until we're able to load a new frame. Reading too far ahead of the screen would overwrite audio that's still playing
+        // In the meantime frames can be decompressed into VRAM
+        while (numFramesQueue >= queueSize || ((curFrameBuffer + 1) % queueSize) == drawFrame || ticksRead - ticksShown >= queueSize) {
+            for (int i = 0; i < numScreens; i++) {
+                decompressToVram(screens[i]);
+            }
+        }
 
-        // Load audio every 4 frames
-        if (!(framesRead % 4)) {
+        // Load all audio blocks that cover the VBlanks up to the next frame
+        while (audioBlocksRead * ticksPerAudioBlock <= ticksRead) {
             if (framesRead < numFrames) {
                 // Read audio blocks
-                fread(&audioL[audioBlock * sampleSize], 1, sampleSize * 2, videoFile);
-                fread(&audioR[audioBlock * sampleSize], 1, sampleSize * 2, videoFile);
+                readAudioBlock();
 
                 // Flush the cache
-                DC_FlushRange(&audioL[audioBlock * sampleSize], sampleSize * 2);
-                DC_FlushRange(&audioR[audioBlock * sampleSize], sampleSize * 2);
+                DC_FlushRange(&audioL[audioBlock * blockSamples], blockSamples * 2);
+                DC_FlushRange(&audioR[audioBlock * blockSamples], blockSamples * 2);
 
                 // Activate audio streaming on frame 0
-                if (framesRead == 0) {
-                    soundPlaySample(audioL, SoundFormat_16Bit, sampleSize * audioBufferSize * 2, sampleSize * audioBufferSize, 127, 0, true, 0);
-                    soundPlaySample(audioR, SoundFormat_16Bit, sampleSize * audioBufferSize * 2, sampleSize * audioBufferSize, 127, 127, true, 0);
+                if (audioBlocksRead == 0) {
+                    // Every block lasts ticksPerAudioBlock VBlanks, which gives the sample rate
+                    int rate = blockSamples * 60 / ticksPerAudioBlock;
+                    soundPlaySample(audioL, SoundFormat_16Bit, blockSamples * audioBufferSize * 2, rate, 127, 0, true, 0);
+                    uint16_t* right = (videoFlags & VIDEO_FLAG_MONO) ? audioL : audioR;
+                    soundPlaySample(right, SoundFormat_16Bit, blockSamples * audioBufferSize * 2, rate, 127, 127, true, 0);
                 }
 
                 audioBlock = (audioBlock + 1) % audioBufferSize;
             } else {
-                memset(&audioL[audioBlock * sampleSize], 0, sampleSize * 2);
-                memset(&audioR[audioBlock * sampleSize], 0, sampleSize * 2);
+                memset(&audioL[audioBlock * blockSamples], 0, blockSamples * 2);
+                memset(&audioR[audioBlock * blockSamples], 0, blockSamples * 2);
                 audioBlock = (audioBlock + 1) % audioBufferSize;
             }
+            audioBlocksRead++;
         }
 
         if (framesRead < numFrames) {
-            fread(&flags, 1, 1, videoFile);
-            if (flags & (FLAG_COMPRESSION_LZ77 | FLAG_COMPRESSION_CHARACTERS)) {
-                fread(&blockLength, 2, 1, videoFile);
-                fread(vramBuffer, 1, blockLength, videoFile);
+            frameDurations[curFrameBuffer] = 1;
 
-                // Draw the frame that got loaded
-                drawQueue |= (1 << curFrameBuffer);
+            // A frame only counts as loaded once both planes are in the queue, so the pacing covers both screens
+            bool valid = true;
+            for (int i = 0; i < numScreens && valid; i++) {
+                valid = loadPlane(screens[i]);
+            }
+            ticksRead += frameDurations[curFrameBuffer];
 
-                decompress(vramBuffer, frameBuffers[curFrameBuffer], LZ77);
-                DC_FlushRange(frameBuffers[curFrameBuffer], frameBufferSize);
-            } else if (flags == FLAG_COMPRESSION_STAY) {
-                // Don't draw the loaded frame
-                drawQueue &= ~(1 << curFrameBuffer);
-            } else { // If the flag byte is invalid execute this
+            if (!valid) { // If the flag byte is invalid execute this
                 // Don't draw the loaded frame
                 queueLoad = false;
 
                 // Invalidate the counter that counts the frames in the queue so we stop loading new ones
                 curFrameBuffer = queueSize;
                 printf("\x1b[11;1HCritical Error: Invalid flag byte");
+                fprintf(stderr, "Critical Error: Invalid flag byte\n");
             }
 
             // Increment frame counters
@@ -200,7 +665,12 @@ int main()
 
             framesRead++;
         } else {
-            memset(&frameBuffers[curFrameBuffer][1], 0, frameBufferSize);
+            // Keep the time going after the last frame, so the audio buffer gets filled with silence
+            ticksRead++;
+        }
+
+        for (int i = 0; i < numScreens; i++) {
+            decompressToVram(screens[i]);
         }
 
         scanKeys();
@@ -0,0 +1,54 @@
+#include <iostream>
+#include <chrono>
+
+#include "kpvdecode.h"
+
+// Decodes a whole video, checks that the DS player could play it and prints some statistics about it
+int main(int argc, char** argv)
+{
+    std::string path = argc > 1 ? argv[1] : "BadApple.kpv";
+
+    if (argc > 2) {
+        std::cout << "Usage: BadAppleDecode [video.kpv]" << std::endl;
+        return 1;
+    }
+
+    KpvReader reader;
+    if (!reader.open(path)) {
+        std::cout << "Error: " << reader.getError() << std::endl;
+        return 1;
+    }
+
+    uint8_t img[imgWidth * imgHeight];
+    auto start = std::chrono::steady_clock::now();
+
+    for (uint32_t i = 0; i < reader.getNumFrames(); i++) {
+        if (!reader.readFrame()) {
+            std::cout << "Error: " << reader.getError() << std::endl;
+            return 1;
+        }
+
+        for (int plane = 0; plane < reader.getNumPlanes(); plane++) {
+            if (!reader.render(plane, img)) {
+                std::cout << "Error: Frame " << i << ": " << reader.getError() << std::endl;
+                return 1;
+            }
+        }
+    }
+
+    auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    const KpvStats& stats = reader.getStats();
+
+    std::cout << "Frames:          " << reader.getNumFrames() << " (" << stats.ticks / static_cast<double>(displayRate) << " s)\n"
+              << "Planes:          " << stats.planes << " (" << stats.stayPlanes << " STAY, " << stats.vramPlanes << " VRAM safe, "
+              << stats.lz11Planes << " LZ11, " << stats.dictPlanes << " with dictionary, " << stats.residualPlanes << " residual, " << stats.splitPlanes << " split, " << stats.bilevelPlanes << " bilevel, " << stats.planes4bpp << " 4bpp, " << stats.scrollPlanes << " scrolled, " << stats.metatilePlanes << " metatiles, " << stats.referencePlanes << " from a reference slot)\n"
+              << "Video bytes:     " << stats.videoBytes << "\n"
+              << "Audio bytes:     " << stats.audioBytes << "\n"
+              << "Audio blocks:    " << stats.audioBlocks << " (" << stats.silentBlocks << " silent, " << stats.monoBlocks << " mono, "
+              << audioBlockSamples(reader.getVideoFlags()) << " samples at " << audioRate(audioBlockSamples(reader.getVideoFlags())) << " Hz)\n"
+              << "LZ10:            " << stats.lz10Bytes << " bytes in " << stats.lz10Time / 1e6 << " ms (" << stats.lz10Bytes / (stats.lz10Time / 1e3 + 1) << " MB/s)\n"
+              << "LZ11:            " << stats.lz11Bytes << " bytes in " << stats.lz11Time / 1e6 << " ms (" << stats.lz11Bytes / (stats.lz11Time / 1e3 + 1) << " MB/s)\n"
+              << "Decode time:     " << seconds * 1000 << " ms" << std::endl;
+
+    return 0;
+}
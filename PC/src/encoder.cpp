@@ -0,0 +1,1398 @@
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <array>
+#include <unordered_set>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "lzss.h"
+#include "lz11.h"
+#include "encoder.h"
+#include "scale.h"
+
+constexpr int chainWindow = 256;    // How many characters get compared per step while chaining, so a frame takes O(n) time
+
+// Motion search
+constexpr int motionScale = 4;      // The search runs on images downscaled by this much first and only refines the best match
+constexpr int maxMotion = 16;       // Furthest the image can move between two frames in either direction
+
+// Grid phase search
+constexpr int numGridPhases = tileWidth * tileHeight;  // Every way the tile grid can be shifted
+constexpr int gridPhaseCandidates = 2;  // How many of the phases with the fewest unique tiles get compressed for real
+
+// Storing characters in classes makes it a bit easier to work with them later on
+class Character {
+public:
+    Character() : pixels{} {}
+
+    uint8_t* getPixels() {
+        return pixels;
+    }
+
+private:
+    uint8_t pixels[tileWidth * tileHeight];
+};
+
+bool operator==(Character& c1, Character& c2) {
+    for (int i = 0; i < tileWidth * tileHeight; i++) {
+        if (c1.getPixels()[i] != c2.getPixels()[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Get the perceived brightness. Integer math keeps gray pixels at exactly their level
+uint8_t getBrightness(const uint8_t* pixel) {
+    return static_cast<uint8_t>((2126 * pixel[0] + 7152 * pixel[1] + 722 * pixel[2]) / 10000);
+}
+
+// Converts an RGB (3 channels) or grayscale (1 channel) image that already has the size of the screens into brightness
+// levels based on our grayscale perception
+void convertToLevels(const uint8_t* pixels, int channels, uint8_t* img, int numPixels) {
+    for (int i = 0; i < numPixels; i++) {
+        if (channels == 1) {
+            img[i] = pixels[i] >> 3;
+        } else {
+            uint8_t pixel[3] = {static_cast<uint8_t>(pixels[i * 3] >> 3), static_cast<uint8_t>(pixels[i * 3 + 1] >> 3), static_cast<uint8_t>(pixels[i * 3 + 2] >> 3)};
+            img[i] = getBrightness(pixel);
+        }
+    }
+}
+
+// Checks if a given tile is in the tile map
+bool checkForTile(std::vector<Character>& tileMap, Character& tile, uint16_t* location = nullptr) {
+    for (size_t i = 0; i < tileMap.size(); i++) {
+        if (tileMap[i] == tile) {
+            if (location != nullptr) {
+                *location = i;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+// Finds the tile in the tile map that looks the most like the given one
+uint16_t findClosestTile(std::vector<Character>& tileMap, Character& tile) {
+    uint16_t closest = 0;
+    int closestDiff = INT32_MAX;
+
+    for (size_t i = 0; i < tileMap.size(); i++) {
+        int diff = 0;
+        for (int j = 0; j < tileWidth * tileHeight; j++) {
+            diff += abs(tileMap[i].getPixels()[j] - tile.getPixels()[j]);
+        }
+
+        if (diff < closestDiff) {
+            closest = i;
+            closestDiff = diff;
+        }
+    }
+    return closest;
+}
+
+// Checks if every pixel of a tile has the same value
+bool isSolidTile(Character& tile) {
+    for (int i = 1; i < tileWidth * tileHeight; i++) {
+        if (tile.getPixels()[i] != tile.getPixels()[0]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Loads tile map from image
+// Only maxTiles characters fit into a frame buffer. Any other tiles get replaced by the closest one in the image.
+// With solidTiles, solid tiles point at the solid tile bank instead. The image has mapRows rows of tiles, and the
+// characters start right after the map
+void loadTileMap(std::vector<Character>& tileMap, uint16_t* map, uint8_t* img, bool solidTiles, int mapRows = imgHeight / tileHeight) {
+    tileMap.clear();
+    Character tileBuffer;
+    uint16_t index;
+    int firstTile = mapRows * (imgWidth / tileWidth) * 2 / tileSize;
+    size_t tileLimit = (solidTiles ? maxTilesWithBank : maxTiles) - (firstTile - tileOffset);
+
+    // Iterates over all tiles in the image
+    for (int y = 0; y < mapRows * tileHeight; y += tileHeight) {
+        for (int x = 0; x < imgWidth; x += tileWidth) {
+            // Copies a tile into the tileBuffer
+            for (int h = 0; h < tileHeight; h++) {
+                memcpy(&tileBuffer.getPixels()[h * tileWidth], &img[(y + h) * imgWidth + x], tileWidth);
+            }
+
+            // Checks if the tile is solid or already in the tile map
+            if (solidTiles && isSolidTile(tileBuffer)) {
+                map[(y / tileHeight) * imgWidth / tileWidth + x / tileWidth] = solidTileBase + tileBuffer.getPixels()[0];
+            } else if (checkForTile(tileMap, tileBuffer, &index)) {
+                map[(y / tileHeight) * imgWidth / tileWidth + x / tileWidth] = index + firstTile;
+            } else if (tileMap.size() < tileLimit) {
+                map[(y / tileHeight) * imgWidth / tileWidth + x / tileWidth] = tileMap.size() + firstTile;
+                tileMap.push_back(tileBuffer);
+            } else {
+                index = findClosestTile(tileMap, tileBuffer);
+                map[(y / tileHeight) * imgWidth / tileWidth + x / tileWidth] = index + firstTile;
+
+                // Write the replacement back, so the image matches what the DS shows
+                for (int h = 0; h < tileHeight; h++) {
+                    memcpy(&img[(y + h) * imgWidth + x], &tileMap[index].getPixels()[h * tileWidth], tileWidth);
+                }
+            }
+        }
+    }
+}
+
+// Counts the pixels two characters differ in. LZ only cares about exact matches, not about how close they are
+int countDifferences(Character& c1, Character& c2) {
+    int diff = 0;
+    for (int i = 0; i < tileWidth * tileHeight; i++) {
+        diff += c1.getPixels()[i] != c2.getPixels()[i];
+    }
+    return diff;
+}
+
+// Reorders the tile map, so similar characters end up close to each other and LZ finds more matches. lastTiles are the
+// characters of the previous frame buffer. Only the order changes, so the map with its mapEntries entries gets updated to match
+void orderTiles(std::vector<Character>& tileMap, uint16_t* map, const uint8_t* lastTiles, int tileOrder, int mapEntries = mapSize) {
+    int numTiles = tileMap.size();
+    std::vector<int> order;     // Old index of every new slot
+    order.reserve(numTiles);
+
+    if (tileOrder == TILE_ORDER_CHAIN) {
+        // Greedy nearest neighbour: only the next chainWindow characters that are left get compared
+        std::vector<int> left(numTiles);
+        for (int i = 0; i < numTiles; i++) {
+            left[i] = i;
+        }
+
+        while (!left.empty()) {
+            size_t next = 0;
+            if (!order.empty()) {
+                int nextDiff = INT32_MAX;
+                for (size_t i = 0; i < left.size() && i < chainWindow; i++) {
+                    int diff = countDifferences(tileMap[order.back()], tileMap[left[i]]);
+                    if (diff < nextDiff) {
+                        next = i;
+                        nextDiff = diff;
+                    }
+                }
+            }
+            order.push_back(left[next]);
+            left.erase(left.begin() + next);
+        }
+    } else if (tileOrder == TILE_ORDER_STABLE) {
+        // Find every character of the previous frame that is still in use
+        std::map<std::array<uint8_t, tileSize>, int> lastSlots;
+        for (int slot = numTiles - 1; slot >= 0; slot--) {
+            std::array<uint8_t, tileSize> pixels;
+            memcpy(pixels.data(), &lastTiles[slot * tileSize], tileSize);
+            lastSlots[pixels] = slot;
+        }
+
+        order.assign(numTiles, -1);
+        std::vector<int> newTiles;
+        for (int i = 0; i < numTiles; i++) {
+            std::array<uint8_t, tileSize> pixels;
+            memcpy(pixels.data(), tileMap[i].getPixels(), tileSize);
+
+            auto it = lastSlots.find(pixels);
+            if (it != lastSlots.end() && order[it->second] == -1) {
+                order[it->second] = i;
+            } else {
+                newTiles.push_back(i);
+            }
+        }
+
+        // Everything else fills up the free slots
+        auto newTile = newTiles.begin();
+        for (int& slot : order) {
+            if (slot == -1) {
+                slot = *newTile++;
+            }
+        }
+    } else {
+        return;
+    }
+
+    std::vector<uint16_t> slots(numTiles);
+    std::vector<Character> ordered(numTiles);
+    for (int slot = 0; slot < numTiles; slot++) {
+        slots[order[slot]] = slot;
+        ordered[slot] = tileMap[order[slot]];
+    }
+    tileMap = ordered;
+
+    // Solid tiles stay in the solid tile bank
+    int firstTile = mapEntries * 2 / tileSize;
+    for (int i = 0; i < mapEntries; i++) {
+        if (map[i] - firstTile < numTiles) {
+            map[i] = slots[map[i] - firstTile] + firstTile;
+        }
+    }
+}
+
+// Ways a frame buffer can be fed into the LZ stage
+enum FrameMode {
+    MODE_INTRA,         // On its own
+    MODE_DICT,          // With the start of the previous frame buffer as dictionary
+    MODE_RESIDUAL,      // XORed with the previous frame buffer, so everything that didn't change becomes 0
+    MODE_COUNT
+};
+
+// Compresses data with LZ10 or LZ11, optionally with a dictionary in front of it. The result has to be freed
+uint8_t* compressStream(uint8_t* data, int size, bool lz11, uint8_t* dict, const EncoderOptions& options, LZS_Context* lzs,
+                        int* newSize) {
+    if (lz11) {
+        return reinterpret_cast<uint8_t*>(LZ11_Encode(data, size, newSize, options.vramSafe, dict, dict ? dictSize : 0));
+    } else if (dict) {
+        return reinterpret_cast<uint8_t*>(LZS_FastDict(lzs, data, size, newSize, options.vramSafe, dict, dictSize));
+    }
+    return reinterpret_cast<uint8_t*>(LZS_Fast(lzs, data, size, newSize, options.vramSafe));
+}
+
+// Compresses the high bytes of the map, the low bytes of the map and the characters as separate streams (EXT_FLAG_SPLIT).
+// The result has to be freed
+uint8_t* compressSplit(uint8_t* data, int size, bool lz11, const EncoderOptions& options, LZS_Context* lzs, int* newSize) {
+    std::vector<uint8_t> planes[2];
+    for (int i = 0; i < mapSize; i++) {
+        planes[0].push_back(data[i * 2 + 1]);
+        planes[1].push_back(data[i * 2]);
+    }
+
+    int lengths[3];
+    uint8_t* streams[3];
+    streams[0] = compressStream(planes[0].data(), mapSize, lz11, nullptr, options, lzs, &lengths[0]);
+    streams[1] = compressStream(planes[1].data(), mapSize, lz11, nullptr, options, lzs, &lengths[1]);
+    streams[2] = compressStream(&data[mapSize * 2], size - mapSize * 2, lz11, nullptr, options, lzs, &lengths[2]);
+
+    // The map streams get padded, so every stream starts word aligned
+    int paddedLengths[2] = {(lengths[0] + 3) & ~3, (lengths[1] + 3) & ~3};
+    *newSize = splitHeaderSize + paddedLengths[0] + paddedLengths[1] + lengths[2];
+
+    auto* result = static_cast<uint8_t*>(calloc(*newSize, 1));
+    uint8_t* pos = result;
+    for (int length : paddedLengths) {
+        *pos++ = length & 0xFF;
+        *pos++ = (length >> 8) & 0xFF;
+    }
+    for (int i = 0; i < 3; i++) {
+        memcpy(pos, streams[i], lengths[i]);
+        pos += i < 2 ? paddedLengths[i] : lengths[i];
+        free(streams[i]);
+    }
+    return result;
+}
+
+// Packs the characters of a frame buffer that only use two values into bilevelTileSize bytes (EXT_FLAG_BILEVEL)
+std::vector<uint8_t> packBilevel(const uint8_t* buffer, int size) {
+    int numTiles = (size - mapSize * 2) / tileSize;
+    std::vector<uint8_t> packed(buffer, buffer + mapSize * 2);
+    packed.push_back(numTiles & 0xFF);
+    packed.push_back((numTiles >> 8) & 0xFF);
+
+    size_t classes = packed.size();
+    packed.resize(packed.size() + (numTiles + 7) / 8, 0);
+
+    for (int i = 0; i < numTiles; i++) {
+        const uint8_t* tile = &buffer[mapSize * 2 + i * tileSize];
+
+        // The first value is level 0, the first one that's different is level 1
+        uint8_t levels[2] = {tile[0], tile[0]};
+        bool bilevel = true;
+        for (int j = 0; j < tileSize && bilevel; j++) {
+            if (tile[j] != levels[0] && levels[1] == levels[0]) {
+                levels[1] = tile[j];
+            }
+            bilevel = tile[j] == levels[0] || tile[j] == levels[1];
+        }
+
+        if (!bilevel) {
+            packed.insert(packed.end(), tile, tile + tileSize);
+            continue;
+        }
+
+        packed[classes + i / 8] |= 1 << (i % 8);
+        packed.push_back(levels[0]);
+        packed.push_back(levels[1]);
+        for (int y = 0; y < tileHeight; y++) {
+            uint8_t mask = 0;
+            for (int x = 0; x < tileWidth; x++) {
+                if (tile[y * tileWidth + x] != levels[0]) {
+                    mask |= 1 << x;
+                }
+            }
+            packed.push_back(mask);
+        }
+    }
+    return packed;
+}
+
+// Replaces the map of a frame buffer by a table of all different 2x2 blocks of map entries and a map of those (EXT_FLAG_METATILE)
+std::vector<uint8_t> packMetatiles(const uint8_t* buffer, int size) {
+    const auto* map = reinterpret_cast<const uint16_t*>(buffer);
+    std::map<std::array<uint16_t, metatileEntries>, uint8_t> indices;
+    std::vector<uint8_t> metatileMap;
+
+    for (int y = 0; y < imgHeight / tileHeight; y += 2) {
+        for (int x = 0; x < imgWidth / tileWidth; x += 2) {
+            int entry = y * (imgWidth / tileWidth) + x;
+            std::array<uint16_t, metatileEntries> metatile = {map[entry], map[entry + 1], map[entry + imgWidth / tileWidth],
+                                                              map[entry + imgWidth / tileWidth + 1]};
+            auto it = indices.find(metatile);
+            if (it == indices.end()) {
+                it = indices.emplace(metatile, indices.size()).first;
+            }
+            metatileMap.push_back(it->second);
+        }
+    }
+
+    // The table is in the order the metatiles first show up
+    std::vector<std::array<uint16_t, metatileEntries>> table(indices.size());
+    for (auto& [metatile, index] : indices) {
+        table[index] = metatile;
+    }
+
+    std::vector<uint8_t> packed = {static_cast<uint8_t>(table.size() & 0xFF), static_cast<uint8_t>(table.size() >> 8)};
+    for (auto& metatile : table) {
+        for (uint16_t entry : metatile) {
+            packed.push_back(entry & 0xFF);
+            packed.push_back(entry >> 8);
+        }
+    }
+    packed.insert(packed.end(), metatileMap.begin(), metatileMap.end());
+    packed.insert(packed.end(), buffer + mapSize * 2, buffer + size);
+    return packed;
+}
+
+// Converts a frame into 4bpp characters with a palette bank each (EXT_FLAG_4BPP). Returns false if a character doesn't
+// fit into any palette bank, so the frame has to stay 8bpp
+bool convertTo4bpp(const uint16_t* map, std::vector<Character>& tileMap, std::vector<uint8_t>& buffer, int mapEntries = mapSize) {
+    std::vector<Character> tiles = tileMap;
+    std::vector<uint16_t> entries(map, map + mapEntries);
+    int firstTile = mapEntries * 2 / tileSize;
+
+    // Solid tile bank entries become regular characters
+    for (auto& entry : entries) {
+        if (entry >= solidTileBase) {
+            Character solid;
+            memset(solid.getPixels(), entry - solidTileBase, tileSize);
+            uint16_t index;
+            if (!checkForTile(tiles, solid, &index)) {
+                index = tiles.size();
+                tiles.push_back(solid);
+            }
+            entry = index + firstTile;
+        }
+    }
+
+    // Characters that only differ by a brightness offset become the same 4bpp character with a different palette bank
+    std::map<std::array<uint8_t, tileSize4bpp>, uint16_t> uniqueTiles;
+    std::vector<uint16_t> tileEntries(tiles.size());
+    buffer.assign(mapEntries * 2, 0);
+
+    for (size_t i = 0; i < tiles.size(); i++) {
+        const uint8_t* pixels = tiles[i].getPixels();
+        int minLevel = numLevels, maxLevel = 0;
+        for (int j = 0; j < tileSize; j++) {
+            if (pixels[j]) {
+                minLevel = std::min<int>(minLevel, pixels[j]);
+                maxLevel = std::max<int>(maxLevel, pixels[j]);
+            }
+        }
+
+        // The bank that starts the closest to the lowest level makes the character relative to it
+        int bank = -1;
+        for (int b = 0; b < numPaletteBanks; b++) {
+            bool fits = minLevel > maxLevel || (minLevel >= paletteBankStart(b) && maxLevel < paletteBankStart(b) + paletteBankLevels);
+            if (fits && (bank == -1 || paletteBankStart(b) > paletteBankStart(bank))) {
+                bank = b;
+            }
+        }
+        if (bank == -1) {
+            return false;
+        }
+
+        std::array<uint8_t, tileSize4bpp> tile{};
+        for (int j = 0; j < tileSize; j++) {
+            int color = pixels[j] ? pixels[j] - paletteBankStart(bank) + 1 : 0;
+            tile[j / 2] |= color << ((j % 2) * 4);
+        }
+
+        auto it = uniqueTiles.find(tile);
+        if (it == uniqueTiles.end()) {
+            it = uniqueTiles.emplace(tile, uniqueTiles.size()).first;
+            buffer.insert(buffer.end(), tile.begin(), tile.end());
+        }
+        tileEntries[i] = (it->second + mapEntries * 2 / tileSize4bpp) | (bank << 12);
+    }
+
+    for (int i = 0; i < mapEntries; i++) {
+        uint16_t entry = tileEntries[entries[i] - firstTile];
+        buffer[i * 2] = entry & 0xFF;
+        buffer[i * 2 + 1] = entry >> 8;
+    }
+    return true;
+}
+
+// Compresses a frame buffer with every enabled method and returns the smallest result, which has to be freed. lz10Size
+// is the size it would have had with plain LZ10
+uint8_t* compressBuffer(uint8_t* buffer, int size, int plane, uint8_t& flags, uint8_t& extFlags, size_t& compressedSize,
+                        size_t& lz10Size, const EncoderOptions& options, EncoderState& state, LZS_Context* lzs) {
+    uint8_t frameExtFlags = extFlags;   // Flags that describe the frame buffer itself
+    uint8_t* lastBuffer = state.lastBuffer[plane];
+    uint8_t* best = nullptr;
+    int candidateSize;
+
+    std::vector<uint8_t> residual(buffer, buffer + size);
+    for (int i = 0; i < size; i++) {
+        residual[i] ^= lastBuffer[i];
+    }
+
+    // The DS decompresses the packed frame into a spare frame buffer first, so it has to fit into one
+    std::vector<uint8_t> bilevel;
+    if (options.bilevel && !(frameExtFlags & EXT_FLAG_4BPP)) {
+        bilevel = packBilevel(buffer, size);
+    }
+    bool bilevelFits = !bilevel.empty() && bilevel.size() <= frameBufferSize;
+
+    // A scrolled frame has a 25th map row, which doesn't make up a row of metatiles
+    std::vector<uint8_t> metatiles;
+    if (options.metatiles && !(frameExtFlags & EXT_FLAG_SCROLL)) {
+        metatiles = packMetatiles(buffer, size);
+
+        // Just like packed frames, the DS decompresses it into a spare frame buffer first
+        if (metatiles.size() > frameBufferSize) {
+            metatiles.clear();
+        }
+    }
+
+    for (int mode = MODE_INTRA; mode < MODE_COUNT; mode++) {
+        if ((mode == MODE_DICT && !options.dictionary) || (mode == MODE_RESIDUAL && !options.residual)) {
+            continue;
+        }
+
+        uint8_t* dict = mode == MODE_DICT ? lastBuffer : nullptr;
+
+        // LZ11 is a lot better at long runs of the same data, but takes longer to decompress on the DS
+        for (int candidateType = 0; candidateType < 16; candidateType++) {
+            bool lz11 = candidateType & 1;
+            bool split = candidateType & 2;
+            bool packed = candidateType & 4;
+            bool metatile = candidateType & 8;
+            if ((lz11 && !options.lz11) || (split && (!options.split || dict)) || (packed && (!bilevelFits || mode == MODE_RESIDUAL)) ||
+                (metatile && (metatiles.empty() || mode == MODE_RESIDUAL || split || packed))) {
+                continue;
+            }
+
+            uint8_t* data = mode == MODE_RESIDUAL ? residual.data() : buffer;
+            int dataSize = size;
+            if (packed) {
+                data = bilevel.data();
+                dataSize = bilevel.size();
+            }
+            if (metatile) {
+                data = metatiles.data();
+                dataSize = metatiles.size();
+            }
+
+            uint8_t* candidate;
+            if (split) {
+                candidate = compressSplit(data, dataSize, lz11, options, lzs, &candidateSize);
+            } else {
+                candidate = compressStream(data, dataSize, lz11, dict, options, lzs, &candidateSize);
+                if (mode == MODE_INTRA && candidateType == 0) {
+                    lz10Size = candidateSize;
+                }
+            }
+
+            if (!best || static_cast<size_t>(candidateSize) < compressedSize) {
+                free(best);
+                best = candidate;
+                compressedSize = candidateSize;
+                flags = FLAG_COMPRESSION_CHARACTERS | FLAG_COMPRESSION_LZ77;
+                extFlags = frameExtFlags;
+                if (lz11) {
+                    flags |= FLAG_COMPRESSION_LZ11;
+                }
+                if (mode == MODE_DICT) {
+                    flags |= FLAG_COMPRESSION_DICT;
+                }
+                if (mode == MODE_RESIDUAL) {
+                    extFlags |= EXT_FLAG_RESIDUAL;
+                }
+                if (split) {
+                    extFlags |= EXT_FLAG_SPLIT;
+                }
+                if (packed) {
+                    extFlags |= EXT_FLAG_BILEVEL;
+                }
+                if (metatile) {
+                    extFlags |= EXT_FLAG_METATILE;
+                }
+            } else {
+                free(candidate);
+            }
+        }
+    }
+
+    if (options.vramSafe) {
+        flags |= FLAG_COMPRESSION_VRAM;
+    }
+    return best;
+}
+
+// Counts a compressed frame buffer in the statistics and keeps it, so the next frame can be compressed against it
+void commitBuffer(const uint8_t* buffer, int size, int plane, uint8_t flags, uint8_t extFlags, size_t compressedSize,
+                  size_t lz10Size, EncoderState& state) {
+    state.lz10Bytes += lz10Size;
+    state.imgDataBytes += compressedSize;
+    if (flags & FLAG_COMPRESSION_LZ11) {
+        state.lz11Frames++;
+    }
+    if (flags & FLAG_COMPRESSION_DICT) {
+        state.dictFrames++;
+    }
+    if (extFlags & EXT_FLAG_RESIDUAL) {
+        state.residualFrames++;
+    }
+    if (extFlags & EXT_FLAG_SPLIT) {
+        state.splitFrames++;
+    }
+    if (extFlags & EXT_FLAG_BILEVEL) {
+        state.bilevelFrames++;
+    }
+    if (extFlags & EXT_FLAG_4BPP) {
+        state.frames4bpp++;
+    }
+    if (extFlags & EXT_FLAG_SCROLL) {
+        state.scrollFrames++;
+    }
+    if (extFlags & EXT_FLAG_METATILE) {
+        state.metatileFrames++;
+    }
+
+    // The next frame gets compressed against this one
+    memset(state.lastBuffer[plane], 0, frameBufferSize);
+    memcpy(state.lastBuffer[plane], buffer, size);
+}
+
+// Sums up the absolute differences between two rows of pixels
+uint32_t sumAbsDiff(const uint8_t* a, const uint8_t* b, int length) {
+    uint32_t sum = 0;
+    int i = 0;
+#ifdef __SSE2__
+    // PSADBW sums up 8 differences at once into each half of the register
+    __m128i total = _mm_setzero_si128();
+    for (; i + 16 <= length; i += 16) {
+        __m128i rowA = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&a[i]));
+        __m128i rowB = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&b[i]));
+        total = _mm_add_epi64(total, _mm_sad_epu8(rowA, rowB));
+    }
+    sum = _mm_cvtsi128_si32(total) + _mm_cvtsi128_si32(_mm_srli_si128(total, 8));
+#endif
+    for (; i < length; i++) {
+        sum += abs(a[i] - b[i]);
+    }
+    return sum;
+}
+
+// Average difference per pixel (times 256) between an image and the previous one moved by dx and dy, where they overlap
+uint32_t motionDifference(const uint8_t* last, const uint8_t* img, int width, int height, int dx, int dy) {
+    int length = width - abs(dx);
+    int rows = height - abs(dy);
+    uint64_t sum = 0;
+    for (int y = std::max(0, dy); y < height + std::min(0, dy); y++) {
+        sum += sumAbsDiff(&img[y * width + std::max(0, dx)], &last[(y - dy) * width + std::max(0, -dx)], length);
+    }
+    return sum * 256 / (length * rows);
+}
+
+// Shrinks an image by motionScale in both directions by averaging
+std::vector<uint8_t> downscale(const uint8_t* img) {
+    std::vector<uint8_t> small((imgWidth / motionScale) * (imgHeight / motionScale));
+    for (int y = 0; y < imgHeight / motionScale; y++) {
+        for (int x = 0; x < imgWidth / motionScale; x++) {
+            int sum = 0;
+            for (int h = 0; h < motionScale; h++) {
+                for (int w = 0; w < motionScale; w++) {
+                    sum += img[(y * motionScale + h) * imgWidth + x * motionScale + w];
+                }
+            }
+            small[y * (imgWidth / motionScale) + x] = sum / (motionScale * motionScale);
+        }
+    }
+    return small;
+}
+
+// Estimates how far the whole image moved since the last one, so that img(x, y) is about last(x - dx, y - dy). The
+// downscaled images give a rough estimate, which only gets refined at full resolution around the best match
+void estimateMotion(const uint8_t* last, const uint8_t* img, int& dx, int& dy) {
+    std::vector<uint8_t> smallLast = downscale(last);
+    std::vector<uint8_t> smallImg = downscale(img);
+    constexpr int smallWidth = imgWidth / motionScale;
+    constexpr int smallHeight = imgHeight / motionScale;
+    constexpr int smallMotion = maxMotion / motionScale;
+
+    int roughX = 0, roughY = 0;
+    uint32_t best = motionDifference(smallLast.data(), smallImg.data(), smallWidth, smallHeight, 0, 0);
+    for (int y = -smallMotion; y <= smallMotion; y++) {
+        for (int x = -smallMotion; x <= smallMotion; x++) {
+            uint32_t diff = motionDifference(smallLast.data(), smallImg.data(), smallWidth, smallHeight, x, y);
+            if (diff < best) {
+                best = diff;
+                roughX = x;
+                roughY = y;
+            }
+        }
+    }
+
+    // Standing still wins every tie, since it doesn't need a scroll offset
+    dx = 0;
+    dy = 0;
+    best = motionDifference(last, img, imgWidth, imgHeight, 0, 0);
+    for (int y = roughY * motionScale - motionScale + 1; y < (roughY + 1) * motionScale; y++) {
+        for (int x = roughX * motionScale - motionScale + 1; x < (roughX + 1) * motionScale; x++) {
+            if (abs(x) > maxMotion || abs(y) > maxMotion) {
+                continue;
+            }
+            uint32_t diff = motionDifference(last, img, imgWidth, imgHeight, x, y);
+            if (diff < best) {
+                best = diff;
+                dx = x;
+                dy = y;
+            }
+        }
+    }
+}
+
+// A frame buffer that's ready to be compressed, along with the image the DS shows for it
+struct FrameCandidate {
+    std::vector<uint8_t> buffer;
+    std::vector<uint8_t> img;
+    uint8_t extFlags = 0;
+    uint8_t scroll[2] = {};
+};
+
+// An image cut into characters, before they get ordered
+struct TiledImage {
+    bool scroll = false;
+    int scrollX = 0;
+    int scrollY = 0;
+    int mapRows = 0;
+    std::vector<uint8_t> bgImg;         // The image on the BG, where the characters that didn't fit got replaced
+    std::vector<Character> tileMap;
+    std::vector<uint16_t> map;
+};
+
+// Everything the tile stage finds out about a plane of an image before it's compressed
+struct PlaneAnalysis {
+    uint64_t hash = 0;                  // Hash of the image, if there are reference slots
+    std::vector<int> gridPhases;        // Grid phases sorted by the number of unique tiles, with gridPhase
+    TiledImage tiled;                   // The image cut into characters without scrolling
+};
+
+// Puts an image onto a BG with mapRows rows of tiles where it shows up with the given scroll offset. The lines of the
+// border tiles that aren't on screen get filled up with the closest line that is, so they don't add any new detail
+std::vector<uint8_t> placeOnBg(const uint8_t* img, int mapRows, int scrollX, int scrollY) {
+    std::vector<uint8_t> bgImg(imgWidth * mapRows * tileHeight);
+    for (int y = 0; y < mapRows * tileHeight; y++) {
+        int imgY = std::clamp(y - scrollY, 0, imgHeight - 1);
+        for (int x = 0; x < imgWidth; x++) {
+            bgImg[y * imgWidth + ((x + scrollX) % imgWidth)] = img[imgY * imgWidth + x];
+        }
+    }
+    return bgImg;
+}
+
+// Quickly counts the different characters an image needs with the tile grid shifted by scrollX and scrollY. Solid tiles
+// don't count with solidTiles, since they are in the solid tile bank
+int countUniqueTiles(const uint8_t* img, int scrollX, int scrollY, bool solidTiles) {
+    constexpr int mapRows = imgHeight / tileHeight + 1;
+    std::vector<uint8_t> bgImg = placeOnBg(img, mapRows, scrollX, scrollY);
+    std::unordered_set<uint64_t> hashes;
+
+    for (int y = 0; y < mapRows * tileHeight; y += tileHeight) {
+        for (int x = 0; x < imgWidth; x += tileWidth) {
+            // FNV-1a over the tile. A collision only makes the estimate a bit off
+            uint64_t hash = 0xCBF29CE484222325;
+            bool solid = true;
+            for (int h = 0; h < tileHeight; h++) {
+                for (int w = 0; w < tileWidth; w++) {
+                    uint8_t pixel = bgImg[(y + h) * imgWidth + x + w];
+                    solid = solid && pixel == bgImg[y * imgWidth + x];
+                    hash = (hash ^ pixel) * 0x100000001B3;
+                }
+            }
+            if (!(solidTiles && solid)) {
+                hashes.insert(hash);
+            }
+        }
+    }
+    return hashes.size();
+}
+
+// Estimates every grid phase and returns them sorted by the number of unique tiles they need. This runs on the tile
+// stage, which already works alongside the other stages
+std::vector<int> rankGridPhases(const uint8_t* img, bool solidTiles) {
+    std::vector<int> tileCounts(numGridPhases);
+    for (int phase = 0; phase < numGridPhases; phase++) {
+        tileCounts[phase] = countUniqueTiles(img, phase % tileWidth, phase / tileWidth, solidTiles);
+    }
+
+    std::vector<int> phases(numGridPhases);
+    for (int phase = 0; phase < numGridPhases; phase++) {
+        phases[phase] = phase;
+    }
+    std::stable_sort(phases.begin(), phases.end(), [&](int a, int b) {
+        return tileCounts[a] < tileCounts[b];
+    });
+    return phases;
+}
+
+// Cuts an image into characters. With scroll, the image gets put onto the BG where it shows up with the given scroll
+// offset first. Nothing here depends on earlier frames
+TiledImage tileImage(const uint8_t* img, bool scroll, int scrollX, int scrollY, bool solidTiles) {
+    TiledImage tiled;
+    tiled.scroll = scroll;
+    tiled.scrollX = scrollX;
+    tiled.scrollY = scrollY;
+    tiled.mapRows = imgHeight / tileHeight + (scroll ? 1 : 0);
+    tiled.bgImg = placeOnBg(img, tiled.mapRows, scrollX, scrollY);
+    tiled.map.resize(tiled.mapRows * (imgWidth / tileWidth));
+    loadTileMap(tiled.tileMap, tiled.map.data(), tiled.bgImg.data(), solidTiles, tiled.mapRows);
+    return tiled;
+}
+
+// Turns the characters of an image into a frame buffer
+void buildFrame(TiledImage& tiled, int plane, const EncoderOptions& options, EncoderState& state, FrameCandidate& frame) {
+    int mapEntries = tiled.mapRows * (imgWidth / tileWidth);
+    int scrollX = tiled.scrollX;
+    int scrollY = tiled.scrollY;
+    const std::vector<uint8_t>& bgImg = tiled.bgImg;
+    std::vector<Character>& tileMap = tiled.tileMap;
+    std::vector<uint16_t>& map = tiled.map;
+    orderTiles(tileMap, map.data(), &state.lastBuffer[plane][mapEntries * 2], options.tileOrder, mapEntries);
+
+    // 4bpp characters are half the size, as long as every one of them fits into a palette bank
+    frame.extFlags = tiled.scroll ? EXT_FLAG_SCROLL : 0;
+    if (options.use4bpp && convertTo4bpp(map.data(), tileMap, frame.buffer, mapEntries)) {
+        frame.extFlags |= EXT_FLAG_4BPP;
+    } else {
+        // Copies the tiles behind the map
+        frame.buffer.assign(reinterpret_cast<uint8_t*>(map.data()), reinterpret_cast<uint8_t*>(map.data() + mapEntries));
+        for (auto& tile : tileMap) {
+            frame.buffer.insert(frame.buffer.end(), tile.getPixels(), tile.getPixels() + tileSize);
+        }
+    }
+
+    // Tiles that didn't fit got replaced in bgImg, so the image has to be taken from there
+    frame.img.resize(imgWidth * imgHeight);
+    for (int y = 0; y < imgHeight; y++) {
+        for (int x = 0; x < imgWidth; x++) {
+            frame.img[y * imgWidth + x] = bgImg[(y + scrollY) * imgWidth + ((x + scrollX) % imgWidth)];
+        }
+    }
+    frame.scroll[0] = scrollX;
+    frame.scroll[1] = scrollY;
+}
+
+// FNV-1a over a whole image
+uint64_t hashImage(const uint8_t* img) {
+    uint64_t hash = 0xCBF29CE484222325;
+    for (int i = 0; i < imgWidth * imgHeight; i++) {
+        hash = (hash ^ img[i]) * 0x100000001B3;
+    }
+    return hash;
+}
+
+// Looks for a reference slot that holds the same image, or with a tolerance one that's at most that far off. The image
+// that's on screen never counts as close enough, since the changes would never show up. Returns -1 if there's none
+int findReference(const uint8_t* img, uint64_t hash, int plane, int numSlots, uint32_t tolerance, const EncoderState& state) {
+    const ReferenceSlot* slots = state.references[plane];
+    for (int slot = 0; slot < numSlots; slot++) {
+        if (slots[slot].used && slots[slot].hash == hash && memcmp(slots[slot].img, img, imgWidth * imgHeight) == 0) {
+            return slot;
+        }
+    }
+
+    if (tolerance == 0) {
+        return -1;
+    }
+
+    int closest = -1;
+    uint32_t closestDiff = tolerance + 1;
+    for (int slot = 0; slot < numSlots; slot++) {
+        if (slots[slot].used && memcmp(slots[slot].img, state.bufferImg[plane], imgWidth * imgHeight) != 0) {
+            uint32_t diff = sumAbsDiff(slots[slot].img, img, imgWidth * imgHeight);
+            if (diff < closestDiff) {
+                closest = slot;
+                closestDiff = diff;
+            }
+        }
+    }
+    return closest;
+}
+
+// Compresses a plane of an image against everything that's been shown before. The tile stage already did the work that
+// doesn't depend on earlier frames. expectedImg gets the image the DS should show, which is img except for characters that
+// didn't fit and got replaced. A frame from a reference slot can still be off by the reference tolerance
+void compressFrame(const uint8_t* img, PlaneAnalysis& analysis, int plane, uint8_t*& imgData, uint8_t& flags, uint8_t& extFlags, uint8_t& slot, size_t& imgDataSize,
+                   uint8_t* expectedImg, const EncoderOptions& options, EncoderState& state, LZS_Context* lzs) {
+    uint8_t* bufferImg = state.bufferImg[plane];
+    memcpy(expectedImg, img, imgWidth * imgHeight);
+
+    // Executes if nothing has changed since the last frame
+    if (memcmp(img, bufferImg, imgWidth * imgHeight) == 0) {
+        flags = FLAG_COMPRESSION_STAY;
+        return;
+    }
+
+    // A frame that's already in a reference slot just gets shown from there
+    int numSlots = referenceSlots(options.videoFlags);
+    int reference = numSlots ? findReference(img, analysis.hash, plane, numSlots, options.referenceTolerance, state) : -1;
+    if (reference != -1) {
+        ReferenceSlot& ref = state.references[plane][reference];
+        flags = FLAG_COMPRESSION_STAY;
+        extFlags = EXT_FLAG_REFERENCE;
+        slot = reference;
+        ref.lastUse = state.frameNum;
+        state.referenceFrames++;
+
+        memcpy(state.lastBuffer[plane], ref.buffer, frameBufferSize);
+        memcpy(bufferImg, ref.img, imgWidth * imgHeight);
+        state.scroll[plane][0] = ref.scroll[0];
+        state.scroll[plane][1] = ref.scroll[1];
+        return;
+    }
+
+    // Every frame can be stored unscrolled. With scroll, it can also follow the motion of the image, so the characters
+    // that are still on screen stay where they were on the BG
+    std::vector<FrameCandidate> candidates(1);
+    buildFrame(analysis.tiled, plane, options, state, candidates[0]);
+
+    if (options.scroll) {
+        int dx, dy;
+        estimateMotion(bufferImg, img, dx, dy);
+        int scrollX = (state.scroll[plane][0] - dx + imgWidth) % imgWidth;
+        int scrollY = ((state.scroll[plane][1] - dy) % tileHeight + tileHeight) % tileHeight;
+        if (scrollX != 0 || scrollY != 0) {
+            candidates.emplace_back();
+            TiledImage tiled = tileImage(img, true, scrollX, scrollY, options.videoFlags & VIDEO_FLAG_SOLID_TILES);
+            buildFrame(tiled, plane, options, state, candidates.back());
+        }
+    }
+
+    // With gridPhase, the phases that need the fewest characters get tried as well. The tile columns stay where they
+    // were on the BG, so only the grid moves
+    if (options.gridPhase) {
+        const std::vector<int>& phases = analysis.gridPhases;
+        for (int i = 0; i < gridPhaseCandidates; i++) {
+            int scrollX = (state.scroll[plane][0] & ~(tileWidth - 1)) + phases[i] % tileWidth;
+            int scrollY = phases[i] / tileWidth;
+            if (scrollX == 0 && scrollY == 0) {
+                continue;
+            }
+            candidates.emplace_back();
+            TiledImage tiled = tileImage(img, true, scrollX, scrollY, options.videoFlags & VIDEO_FLAG_SOLID_TILES);
+            buildFrame(tiled, plane, options, state, candidates.back());
+        }
+    }
+
+    // Compress the image using CUE's LZSS function (or whatever else is smaller)
+    FrameCandidate* best = nullptr;
+    size_t bestLz10Size = 0;
+    imgData = nullptr;
+    for (auto& candidate : candidates) {
+        uint8_t candidateFlags;
+        uint8_t candidateExtFlags = candidate.extFlags;
+        size_t candidateSize, lz10Size;
+        uint8_t* data = compressBuffer(candidate.buffer.data(), candidate.buffer.size(), plane, candidateFlags, candidateExtFlags,
+                                       candidateSize, lz10Size, options, state, lzs);
+
+        if (!best || candidateSize < imgDataSize) {
+            free(imgData);
+            imgData = data;
+            imgDataSize = candidateSize;
+            flags = candidateFlags;
+            extFlags = candidateExtFlags;
+            best = &candidate;
+            bestLz10Size = lz10Size;
+        } else {
+            free(data);
+        }
+    }
+    commitBuffer(best->buffer.data(), best->buffer.size(), plane, flags, extFlags, imgDataSize, bestLz10Size, state);
+    state.scroll[plane][0] = best->scroll[0];
+    state.scroll[plane][1] = best->scroll[1];
+
+    // Update the image buffer
+    memmove(bufferImg, best->img.data(), imgWidth * imgHeight);
+    memcpy(expectedImg, bufferImg, imgWidth * imgHeight);
+
+    // The new frame replaces the slot that hasn't been used for the longest time
+    if (numSlots) {
+        slot = 0;
+        for (int i = 0; i < numSlots; i++) {
+            ReferenceSlot& ref = state.references[plane][i];
+            if (!ref.used || (state.references[plane][slot].used && ref.lastUse < state.references[plane][slot].lastUse)) {
+                slot = i;
+            }
+            if (!ref.used) {
+                break;
+            }
+        }
+
+        ReferenceSlot& ref = state.references[plane][slot];
+        ref.used = true;
+        ref.extFlags = extFlags & (EXT_FLAG_4BPP | EXT_FLAG_SCROLL);
+        ref.scroll[0] = state.scroll[plane][0];
+        ref.scroll[1] = state.scroll[plane][1];
+        ref.lastUse = state.frameNum;
+        ref.hash = hashImage(bufferImg);
+        memcpy(ref.img, bufferImg, imgWidth * imgHeight);
+        memcpy(ref.buffer, state.lastBuffer[plane], frameBufferSize);
+        extFlags |= EXT_FLAG_KEEP;
+    }
+}
+
+// Splits one audio block into the left and right channel. Fills the buffers with 0s after the end of the samples
+void readAudioBlock(const int16_t* samples, size_t numSamples, int blockSamples, int16_t* aBufferL, int16_t* aBufferR) {
+    for (int i = 0; i < blockSamples; i++) {
+        // If there's still audio to be read read it. Otherwise fill the buffers with 0s
+        if (static_cast<size_t>(i) < numSamples) {
+            aBufferL[i] = samples[i * 2];
+            aBufferR[i] = samples[i * 2 + 1];
+        } else {
+            aBufferL[i] = 0;
+            aBufferR[i] = 0;
+        }
+    }
+}
+
+// Checks if every sample of a channel is below silenceThreshold
+bool isSilent(const int16_t* samples, int numSamples) {
+    for (int i = 0; i < numSamples; i++) {
+        if (abs(samples[i]) > silenceThreshold) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool isMono(const int16_t* samplesL, const int16_t* samplesR, size_t numSamples, size_t stride) {
+    for (size_t i = 0; i < numSamples; i++) {
+        if (abs(samplesL[i * stride] - samplesR[i * stride]) > monoThreshold) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Appends one audio block made of the first numSamples stereo samples to the video. Silent blocks only take up their
+// type, and mono blocks only store the average of both channels. With forceMono, every block that isn't silent is mono
+void writeAudioBlock(std::vector<uint8_t>& videoData, const int16_t* samples, size_t numSamples, int blockSamples, bool forceMono) {
+    // Audio buffers used for unpacking one stereo track into 2 mono tracks
+    int16_t aBufferL[sampleSize];
+    int16_t aBufferR[sampleSize];
+
+    readAudioBlock(samples, numSamples, blockSamples, aBufferL, aBufferR);
+
+    if (isSilent(aBufferL, blockSamples) && isSilent(aBufferR, blockSamples)) {
+        videoData.push_back(AUDIO_BLOCK_SILENCE);
+        return;
+    }
+
+    if (forceMono || isMono(aBufferL, aBufferR, blockSamples)) {
+        videoData.push_back(AUDIO_BLOCK_MONO);
+        for (int i = 0; i < blockSamples; i++) {
+            auto sample = static_cast<uint16_t>((aBufferL[i] + aBufferR[i]) / 2);
+            videoData.push_back(sample & 0xFF);
+            videoData.push_back(sample >> 8);
+        }
+        return;
+    }
+
+    videoData.push_back(AUDIO_BLOCK_PCM);
+    videoData.insert(videoData.end(), reinterpret_cast<uint8_t*>(aBufferL), reinterpret_cast<uint8_t*>(aBufferL + blockSamples));
+    videoData.insert(videoData.end(), reinterpret_cast<uint8_t*>(aBufferR), reinterpret_cast<uint8_t*>(aBufferR + blockSamples));
+}
+
+// Something that moves through the stages of the encoder. The stages keep the order everything was pushed in
+struct EncoderItem {
+    uint64_t duration = 0;                          // VBlanks the image stays on screen, 0 for audio
+    std::vector<uint8_t> levels;                    // Brightness levels of every plane, from the calling thread
+    std::vector<PlaneAnalysis> planes;              // From the tile stage
+    std::vector<std::vector<uint8_t>> records;      // Records of every frame the image turned into, from the compress stage
+    std::vector<uint64_t> recordBlocks;             // Audio blocks every record needs in front of it
+    std::vector<std::vector<uint8_t>> audioBlocks;  // Audio blocks for audio items
+};
+
+KpvEncoder::KpvEncoder(const EncoderOptions& options, Sink sink, const EncoderState* resumeState)
+    : options(options), state(std::make_unique<EncoderState>()), sink(std::move(sink)), blockSamples(audioBlockSamples(options.videoFlags)) {
+    if (resumeState) {
+        *state = *resumeState;
+    } else {
+        // Header of my video format. The number of frames gets filled in by finish
+        videoData.resize(4);
+        videoData.insert(videoData.end(), reinterpret_cast<const uint8_t*>(&options.videoFlags), reinterpret_cast<const uint8_t*>(&options.videoFlags) + 4);
+        static_assert(headerSize == 8);
+    }
+    pushedTicks = state->displayTick;
+    pushedBlocks = state->audioOff / blockSamples;
+
+    tileQueue = std::make_unique<SpscQueue<EncoderItem>>("convert -> tile");
+    compressQueue = std::make_unique<SpscQueue<EncoderItem>>("tile -> compress");
+    muxQueue = std::make_unique<SpscQueue<EncoderItem>>("compress -> mux");
+    std::vector<PipelineQueue*> queues = {tileQueue.get(), compressQueue.get(), muxQueue.get()};
+    stages[0] = std::make_unique<PipelineStage>(queues, [this] { runTileStage(); });
+    stages[1] = std::make_unique<PipelineStage>(queues, [this] { runCompressStage(); });
+    stages[2] = std::make_unique<PipelineStage>(queues, [this] { runMuxStage(); });
+}
+
+KpvEncoder::~KpvEncoder() = default;
+
+bool KpvEncoder::pushFrame(const uint8_t* pixels, int width, int height, size_t stride, int channels, uint64_t duration) {
+    if (failed || finished) {
+        return false;
+    }
+
+    // Frames that would be replaced before they are shown can be skipped entirely
+    if (duration == 0) {
+        state->sourceFrame++;
+        return true;
+    }
+
+    if (!pixels || width <= 0 || height <= 0 || (channels != 1 && channels != 3) || stride < static_cast<size_t>(width) * channels) {
+        fail("Invalid image");
+        return false;
+    }
+
+    // Turn the image into brightness levels. Images of any other size get scaled to the screens on the way
+    int numPlanes = (options.videoFlags & VIDEO_FLAG_DUAL_SCREEN) ? 2 : 1;
+    EncoderItem item;
+    item.duration = duration;
+    item.levels.resize(imgWidth * imgHeight * numPlanes);
+    if (width == imgWidth && height == imgHeight * numPlanes) {
+        for (int y = 0; y < height; y++) {
+            convertToLevels(pixels + y * stride, channels, &item.levels[y * imgWidth], imgWidth);
+        }
+    } else {
+        scaleToLevels(pixels, channels, width, height, stride, item.levels.data(), imgWidth, imgHeight * numPlanes);
+    }
+
+    // The last frame the image turns into needs the audio up to the VBlank it gets shown at
+    uint64_t lastTick = pushedTicks + (duration - 1) / maxDuration * maxDuration;
+    neededBlocks = preloadBlocks + lastTick / ticksPerAudioBlock + 1;
+    pushedTicks += duration;
+
+    state->sourceFrame++;
+    return pushItem(std::move(item));
+}
+
+bool KpvEncoder::pushAudio(const int16_t* samples, size_t numSamples) {
+    if (failed || finished) {
+        return false;
+    }
+
+    bool forceMono = options.videoFlags & VIDEO_FLAG_MONO;
+    EncoderItem item;
+
+    // An unfinished block from the last call gets filled up first
+    if (!audioCarry.empty()) {
+        size_t fill = std::min<size_t>(numSamples, blockSamples - audioCarry.size() / 2);
+        audioCarry.insert(audioCarry.end(), samples, samples + fill * 2);
+        samples += fill * 2;
+        numSamples -= fill;
+
+        if (audioCarry.size() / 2 == static_cast<size_t>(blockSamples)) {
+            writeAudioBlock(item.audioBlocks.emplace_back(), audioCarry.data(), blockSamples, blockSamples, forceMono);
+            audioCarry.clear();
+        }
+    }
+
+    for (; numSamples >= static_cast<size_t>(blockSamples); numSamples -= blockSamples) {
+        writeAudioBlock(item.audioBlocks.emplace_back(), samples, blockSamples, blockSamples, forceMono);
+        samples += blockSamples * 2;
+    }
+    audioCarry.insert(audioCarry.end(), samples, samples + numSamples * 2);
+
+    pushedBlocks += item.audioBlocks.size();
+    return item.audioBlocks.empty() || pushItem(std::move(item));
+}
+
+bool KpvEncoder::finish() {
+    if (failed || finished) {
+        return false;
+    }
+    finished = true;
+
+    // Missing audio is silent. A started block only gets written if it's needed
+    EncoderItem item;
+    bool forceMono = options.videoFlags & VIDEO_FLAG_MONO;
+    for (; pushedBlocks < neededBlocks; pushedBlocks++) {
+        writeAudioBlock(item.audioBlocks.emplace_back(), audioCarry.data(), audioCarry.size() / 2, blockSamples, forceMono);
+        audioCarry.clear();
+    }
+    if (!item.audioBlocks.empty() && !pushItem(std::move(item))) {
+        return false;
+    }
+
+    tileQueue->close();
+    for (auto& stage : stages) {
+        stage->join();
+    }
+    if (failed) {
+        return false;
+    }
+
+    // Write the number of frames into the file header
+    if (!sink(reinterpret_cast<const uint8_t*>(&state->frameNum), 4, 0)) {
+        fail("Couldn't write the video");
+        return false;
+    }
+    return true;
+}
+
+bool KpvEncoder::drain() {
+    uint64_t muxed;
+    while ((muxed = muxedItems) < pushedItems && !failed) {
+        muxedItems.wait(muxed);
+    }
+    return !failed;
+}
+
+uint64_t KpvEncoder::getMissingAudio() const {
+    uint64_t pushed = pushedBlocks * blockSamples + audioCarry.size() / 2;
+    uint64_t needed = neededBlocks * blockSamples;
+    return needed > pushed ? needed - pushed : 0;
+}
+
+bool KpvEncoder::isIdle() const {
+    return pendingRecords.empty() && pendingBlocks.empty() && audioCarry.empty() && videoData.empty();
+}
+
+std::vector<QueueStats> KpvEncoder::getQueueStats() const {
+    return {tileQueue->getStats(), compressQueue->getStats(), muxQueue->getStats()};
+}
+
+void KpvEncoder::runTileStage() {
+    int numPlanes = (options.videoFlags & VIDEO_FLAG_DUAL_SCREEN) ? 2 : 1;
+    bool solidTiles = options.videoFlags & VIDEO_FLAG_SOLID_TILES;
+    EncoderItem item;
+
+    while (tileQueue->pop(item)) {
+        // Everything that doesn't depend on earlier frames gets done here, while they are still being compressed
+        if (item.duration) {
+            item.planes.resize(numPlanes);
+            for (int plane = 0; plane < numPlanes; plane++) {
+                const uint8_t* img = &item.levels[plane * imgWidth * imgHeight];
+                PlaneAnalysis& analysis = item.planes[plane];
+                if (referenceSlots(options.videoFlags)) {
+                    analysis.hash = hashImage(img);
+                }
+                if (options.gridPhase) {
+                    analysis.gridPhases = rankGridPhases(img, solidTiles);
+                }
+                analysis.tiled = tileImage(img, false, 0, 0, solidTiles);
+            }
+        }
+
+        if (!compressQueue->push(std::move(item))) {
+            return;
+        }
+    }
+    compressQueue->close();
+}
+
+void KpvEncoder::runCompressStage() {
+    int numPlanes = (options.videoFlags & VIDEO_FLAG_DUAL_SCREEN) ? 2 : 1;
+
+    // Decodes everything that gets written, just like the DS would
+    std::unique_ptr<KpvDecoder> verifier;
+
+    // The trees of CUE's LZSS encoder, so several encoders can compress at the same time
+    std::unique_ptr<LZS_Context, void(*)(LZS_Context*)> lzs(LZS_CreateContext(), LZS_FreeContext);
+
+    // Used to compress image data
+    uint8_t* imgData;                          // Stores the compressed image
+    size_t imgDataSize;
+    uint8_t flags;
+    uint8_t extFlags;
+    uint8_t slot;                               // Reference slot of the frame
+    uint8_t verifyImg[imgWidth * imgHeight];
+    std::vector<uint8_t> expectedImgs[maxPlanes];   // What the DS should show for every plane of the current image
+    uint32_t allowedDiff[maxPlanes] = {};           // How far it can be off, which only a reference tolerance allows
+    for (auto& expectedImg : expectedImgs) {
+        expectedImg.resize(imgWidth * imgHeight);
+    }
+    EncoderItem item;
+
+    while (compressQueue->pop(item)) {
+        // verify gets set before the first item is pushed
+        if (verify && !verifier) {
+            verifier = std::make_unique<KpvDecoder>(options.videoFlags);
+        }
+
+        // Frames longer than 255 VBlanks get continued with STAY frames
+        for (bool first = true; item.duration > 0; first = false) {
+            uint8_t frameDuration = std::min<uint64_t>(item.duration, maxDuration);
+
+            // The audio blocks in front of a frame cover everything up to the VBlank it gets shown at
+            item.recordBlocks.push_back(preloadBlocks + state->displayTick / ticksPerAudioBlock + 1);
+            std::vector<uint8_t>& data = item.records.emplace_back();
+
+            // The top screen plane comes first, followed by the bottom screen plane. Only the first plane carries the duration
+            for (int plane = 0; plane < numPlanes; plane++) {
+                extFlags = 0;
+                if (first) {
+                    compressFrame(&item.levels[plane * imgWidth * imgHeight], item.planes[plane], plane, imgData, flags, extFlags, slot,
+                                  imgDataSize, expectedImgs[plane].data(), options, *state, lzs.get());
+                    allowedDiff[plane] = (extFlags & EXT_FLAG_REFERENCE) ? options.referenceTolerance : 0;
+                } else {
+                    flags = FLAG_COMPRESSION_STAY;
+                }
+
+                if (plane == 0 && frameDuration != 1) {
+                    flags |= FLAG_DURATION;
+                }
+                if (extFlags) {
+                    flags |= FLAG_EXTENDED;
+                }
+
+                size_t recordStart = data.size();
+                data.push_back(flags);
+                if (flags & FLAG_EXTENDED) {
+                    data.push_back(extFlags);
+                }
+                if (extFlags & EXT_FLAG_SCROLL) {
+                    data.push_back(state->scroll[plane][0]);
+                    data.push_back(state->scroll[plane][1]);
+                }
+                if (extFlags & (EXT_FLAG_REFERENCE | EXT_FLAG_KEEP)) {
+                    data.push_back(slot);
+                }
+                if (flags & FLAG_DURATION) {
+                    data.push_back(frameDuration);
+                }
+                if (!(flags & FLAG_COMPRESSION_STAY)) {
+                    data.push_back(imgDataSize & 0xFF);
+                    data.push_back((imgDataSize >> 8) & 0xFF);
+                    data.insert(data.end(), imgData, imgData + imgDataSize);
+                    free(imgData);  // Clean up memory used by CUE's LZSS function
+                }
+
+                if (verifier) {
+                    if (!verifier->decodePlane(plane, &data[recordStart], data.size() - recordStart) || !verifier->render(plane, verifyImg)) {
+                        fail("Frame " + std::to_string(state->frameNum) + " can't be decoded: " + verifier->getError());
+                        return;
+                    }
+                    // Checked against what this frame should look like, not against what the encoder thinks is on screen
+                    if (sumAbsDiff(verifyImg, expectedImgs[plane].data(), imgWidth * imgHeight) > allowedDiff[plane]) {
+                        fail("Frame " + std::to_string(state->frameNum) + " doesn't match the image");
+                        return;
+                    }
+                }
+            }
+
+            state->frameNum++;
+            state->displayTick += frameDuration;
+            item.duration -= frameDuration;
+        }
+
+        // The images aren't needed anymore, so they don't have to be moved around any further
+        item.levels = std::vector<uint8_t>();
+        item.planes.clear();
+
+        if (!muxQueue->push(std::move(item))) {
+            return;
+        }
+    }
+    muxQueue->close();
+}
+
+void KpvEncoder::runMuxStage() {
+    EncoderItem item;
+
+    while (muxQueue->pop(item)) {
+        for (size_t i = 0; i < item.records.size(); i++) {
+            pendingRecords.push_back({item.recordBlocks[i], std::move(item.records[i])});
+        }
+        for (auto& block : item.audioBlocks) {
+            pendingBlocks.push_back(std::move(block));
+        }
+
+        writePending();
+        if (!flush()) {
+            fail("Couldn't write the video");
+            return;
+        }
+
+        muxedItems++;
+        muxedItems.notify_all();
+    }
+}
+
+bool KpvEncoder::pushItem(EncoderItem&& item) {
+    if (!tileQueue->push(std::move(item))) {
+        return false;
+    }
+    pushedItems++;
+    return true;
+}
+
+void KpvEncoder::writePending() {
+    while (true) {
+        uint64_t audioBlocks = state->audioOff / blockSamples;
+        uint64_t requiredBlocks = pendingRecords.empty() ? preloadBlocks : pendingRecords.front().audioBlocks;
+        if (audioBlocks < requiredBlocks && !pendingBlocks.empty()) {
+            videoData.insert(videoData.end(), pendingBlocks.front().begin(), pendingBlocks.front().end());
+            pendingBlocks.pop_front();
+
+            state->audioOff += blockSamples;
+            if (audioBlocks >= preloadBlocks) {
+                state->audioBlocks++;
+            }
+        } else if (audioBlocks >= requiredBlocks && !pendingRecords.empty()) {
+            std::vector<uint8_t>& data = pendingRecords.front().data;
+            videoData.insert(videoData.end(), data.begin(), data.end());
+            pendingRecords.pop_front();
+        } else {
+            break;
+        }
+    }
+}
+
+bool KpvEncoder::flush() {
+    if (videoData.empty()) {
+        return true;
+    }
+
+    if (!sink(videoData.data(), videoData.size(), state->outputBytes)) {
+        return false;
+    }
+    state->outputBytes += videoData.size();
+    videoData.clear();
+    return true;
+}
+
+void KpvEncoder::fail(const std::string& message) {
+    {
+        std::lock_guard<std::mutex> lock(errorMutex);
+        if (error.empty()) {
+            error = message;
+        }
+    }
+    failed = true;
+    tileQueue->stop();
+    compressQueue->stop();
+    muxQueue->stop();
+
+    // Wakes up drain
+    muxedItems++;
+    muxedItems.notify_all();
+}
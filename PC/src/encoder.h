@@ -0,0 +1,204 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <atomic>
+#include <mutex>
+
+#include "kpv.h"
+#include "kpvdecode.h"
+#include "pipeline.h"
+
+// The .kpv encoder. It takes the images and the audio as they come in and hands the finished file to a sink piece by piece
+
+// Orders the characters can be stored in
+enum TileOrder {
+    TILE_ORDER_RASTER,  // In the order they first show up in the image
+    TILE_ORDER_CHAIN,   // Every character is followed by the most similar one that's left
+    TILE_ORDER_STABLE,  // Characters that were in the previous frame keep their slot
+};
+
+// Options that change the output, so a checkpoint is only valid if they match
+struct EncoderOptions {
+    uint32_t videoFlags = 0;
+    uint32_t fpsNum = displayRate;  // Frame rate of the source as a fraction
+    uint32_t fpsDen = 1;
+    uint32_t vramSafe = 0;          // Avoid matches the BIOS' VRAM decompression can't handle
+    uint32_t lz11 = 0;              // Also try LZ11 and keep whichever is smaller
+    uint32_t dictionary = 0;        // Also try using the previous frame as a preset dictionary
+    uint32_t residual = 0;          // Also try XORing the frame with the previous one
+    uint32_t split = 0;             // Also try compressing the map bytes and the characters separately
+    uint32_t bilevel = 0;           // Also try packing characters with only two values into 1 bit per pixel
+    uint32_t use4bpp = 0;           // Store frames with 4bpp characters whenever they fit into the palette banks
+    uint32_t scroll = 0;            // Also try following the motion of the image with the BG scroll offset
+    uint32_t gridPhase = 0;         // Also try shifting the tile grid with the BG scroll offset where that saves tiles
+    uint32_t metatiles = 0;         // Also try storing the map as a map of 2x2 blocks of map entries
+    uint32_t tileOrder = TILE_ORDER_RASTER;
+    uint32_t referenceTolerance = 0;    // Total brightness difference an image can have to a reference slot and still be
+                                        // shown from it. 0 only uses exact matches
+
+    bool operator==(const EncoderOptions&) const = default;
+};
+
+// A frame the DS keeps in a reference slot, so it can be shown again later on
+struct ReferenceSlot {
+    bool used;
+    uint8_t extFlags;           // EXT_FLAG_4BPP and EXT_FLAG_SCROLL of the frame
+    uint8_t scroll[2];
+    uint32_t lastUse;           // Frame that got stored in the slot or shown from it last
+    uint64_t hash;              // Hash of img, so exact matches are found right away
+    uint8_t img[imgWidth * imgHeight];
+    uint8_t buffer[frameBufferSize];    // Filled up with 0s
+};
+
+// Everything the encoder needs to remember from one frame to the next
+struct EncoderState {
+    uint32_t frameNum = 0;      // Number of frames that have been written to the video
+    uint32_t sourceFrame = 0;   // Number of source images that have been encoded
+    uint64_t displayTick = 0;   // VBlank at which the next frame gets shown
+    uint32_t audioBlocks = 0;   // Number of audio blocks written after the preloaded ones
+    uint64_t audioOff = 0;      // Number of stereo samples that have been written as audio blocks
+    uint64_t outputBytes = 0;   // Number of bytes that have been handed to the sink
+    uint64_t lz10Bytes = 0;     // Size all compressed frames would have had with LZ10
+    uint64_t imgDataBytes = 0;  // Size of all compressed frames
+    uint32_t lz11Frames = 0;    // Number of frames that use LZ11
+    uint32_t dictFrames = 0;    // Number of frames that use the previous frame as a dictionary
+    uint32_t residualFrames = 0;    // Number of frames XORed with the previous frame
+    uint32_t splitFrames = 0;   // Number of frames with separate map and character streams
+    uint32_t bilevelFrames = 0; // Number of frames with packed two-tone characters
+    uint32_t frames4bpp = 0;    // Number of frames with 4bpp characters
+    uint32_t scrollFrames = 0;  // Number of frames with a BG scroll offset
+    uint32_t metatileFrames = 0;    // Number of frames with a metatile map
+    uint32_t referenceFrames = 0;   // Number of frames shown from a reference slot
+    uint8_t scroll[maxPlanes][2] = {};                          // BG scroll offset of every plane
+    uint8_t bufferImg[maxPlanes][imgWidth * imgHeight] = {};    // Stores the last image of every plane
+    uint8_t lastBuffer[maxPlanes][frameBufferSize] = {};        // Last frame buffer of every plane, filled up with 0s
+    ReferenceSlot references[maxPlanes][maxReferenceSlots] = {};
+};
+
+// Checks if the channels of some samples are at most monoThreshold apart
+bool isMono(const int16_t* samplesL, const int16_t* samplesR, size_t numSamples, size_t stride = 1);
+
+// Something that moves through the stages of the encoder, either an image or audio blocks
+struct EncoderItem;
+
+// Encodes a whole video one image at a time. The calling thread only converts the images into brightness levels. Cutting
+// them into characters, compressing them and writing them out happen on threads of their own, which are connected by
+// bounded queues, so every stage can work on another frame at the same time. Frames only get written once the audio in
+// front of them is there, so the audio should be pushed along with the images (getMissingAudio tells how much they are
+// waiting for). The encoder can only be used from one thread at a time
+class KpvEncoder {
+public:
+    // Gets called with every piece of the file and the offset it belongs at, from a thread of the encoder. Everything gets
+    // appended, except for the number of frames, which finish writes into the header at offset 0. Returns false if it
+    // couldn't be written
+    using Sink = std::function<bool(const uint8_t* data, size_t size, uint64_t offset)>;
+
+    // Starts a new video, or continues one from a state that was saved while it was idle
+    KpvEncoder(const EncoderOptions& options, Sink sink, const EncoderState* resumeState = nullptr);
+    KpvEncoder(const KpvEncoder&) = delete;
+    KpvEncoder& operator=(const KpvEncoder&) = delete;
+    ~KpvEncoder();
+
+    // Converts an RGB (3 channels) or grayscale (1 channel) image that stays on screen for duration VBlanks and hands it to
+    // the other stages. Rows start stride bytes apart, and images that don't have the size of the screens get scaled. The
+    // pixels are only read during the call. Images with a duration of 0 would be replaced before they are shown, so they
+    // only get counted, and pixels can be nullptr for them. Waits while the stages are busy. Returns false once anything
+    // went wrong, after which the encoder stops
+    bool pushFrame(const uint8_t* pixels, int width, int height, size_t stride, int channels, uint64_t duration);
+
+    // Adds interleaved 16 bit stereo samples at the rate of the video. Whole audio blocks get encoded straight from
+    // samples, and only the samples of an unfinished block are kept until the next call
+    bool pushAudio(const int16_t* samples, size_t numSamples);
+
+    // Writes the frames that are still waiting for audio with silence in front of them, stops the stages and fills in
+    // the number of frames
+    bool finish();
+
+    // Waits until the stages have written everything they can. Returns false if anything went wrong
+    bool drain();
+
+    // Number of stereo samples that still have to be pushed before every frame can be written
+    uint64_t getMissingAudio() const;
+
+    // Decodes every frame right after encoding it and checks that it matches the image. Only works from the start and
+    // has to be set before the first frame
+    void setVerify(bool enable) {
+        verify = enable;
+    }
+
+    const EncoderOptions& getOptions() const {
+        return options;
+    }
+
+    // Everything that's needed to continue the video later on. Only consistent after drain, and only usable to continue
+    // if the encoder is idle
+    const EncoderState& getState() const {
+        return *state;
+    }
+
+    // If nothing is waiting for audio after drain
+    bool isIdle() const;
+
+    // How full the queues between the stages were, in the order of the stages
+    std::vector<QueueStats> getQueueStats() const;
+
+    const std::string& getError() const {
+        return error;
+    }
+
+private:
+    // The stages that run on their own threads
+    void runTileStage();
+    void runCompressStage();
+    void runMuxStage();
+
+    // Hands an item to the tile stage
+    bool pushItem(EncoderItem&& item);
+
+    // Writes audio blocks and records as far as the audio that's there allows
+    void writePending();
+
+    // Hands videoData to the sink
+    bool flush();
+
+    // Keeps the first error and stops every stage
+    void fail(const std::string& message);
+
+    EncoderOptions options;
+    std::unique_ptr<EncoderState> state;
+    Sink sink;
+    int blockSamples;
+    bool verify = false;
+    std::string error;
+    std::mutex errorMutex;
+    std::atomic<bool> failed{false};
+
+    // Only used by the calling thread
+    uint64_t pushedTicks;                       // VBlank at which the next image gets shown
+    uint64_t neededBlocks = preloadBlocks;      // Audio blocks the pushed images need in front of them
+    uint64_t pushedBlocks;                      // Audio blocks that have been encoded
+    std::vector<int16_t> audioCarry;            // Samples of an unfinished audio block
+    uint64_t pushedItems = 0;
+    bool finished = false;
+
+    // Only used by the mux stage
+    struct PendingRecord {
+        uint64_t audioBlocks;                   // Audio blocks that have to be written in front of it
+        std::vector<uint8_t> data;              // Records of all planes
+    };
+    std::deque<PendingRecord> pendingRecords;   // Frames that are still waiting for their audio
+    std::deque<std::vector<uint8_t>> pendingBlocks;     // Audio blocks that aren't needed yet
+    std::vector<uint8_t> videoData;             // Data that hasn't been handed to the sink yet
+    std::atomic<uint64_t> muxedItems{0};
+
+    std::unique_ptr<SpscQueue<EncoderItem>> tileQueue;
+    std::unique_ptr<SpscQueue<EncoderItem>> compressQueue;
+    std::unique_ptr<SpscQueue<EncoderItem>> muxQueue;
+    std::unique_ptr<PipelineStage> stages[3];   // Destroyed first, so they stop before anything they use goes away
+};
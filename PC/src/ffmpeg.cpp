@@ -0,0 +1,98 @@
+#include <cstdlib>
+
+#include "ffmpeg.h"
+
+#ifdef _WIN32
+#define popen _popen
+#define pclose _pclose
+#endif
+
+// Turns an argument into something the shell passes on as is
+static std::string quote(const std::string& arg) {
+#ifdef _WIN32
+    std::string quoted = "\"";
+    for (char c : arg) {
+        if (c == '"') {
+            quoted += '\\';
+        }
+        quoted += c;
+    }
+    return quoted + "\"";
+#else
+    std::string quoted = "'";
+    for (char c : arg) {
+        if (c == '\'') {
+            quoted += "'\\''";
+        } else {
+            quoted += c;
+        }
+    }
+    return quoted + "'";
+#endif
+}
+
+// Starts a command line with its standard output going into the returned pipe
+static FILE* openPipe(const std::vector<std::string>& args) {
+    std::string command;
+    for (const auto& arg : args) {
+        if (!command.empty()) {
+            command += ' ';
+        }
+        command += quote(arg);
+    }
+#ifdef _WIN32
+    // cmd.exe strips the outer quotes of the whole command line
+    command = "\"" + command + "\"";
+    return popen(command.c_str(), "rb");
+#else
+    return popen(command.c_str(), "r");
+#endif
+}
+
+FILE* startVideoDecoder(const std::string& ffmpeg, const std::string& path) {
+    return openPipe({ffmpeg, "-v", "error", "-nostdin", "-i", path, "-an", "-vf", "scale=out_range=full", "-pix_fmt", "gray",
+                     "-f", "yuv4mpegpipe", "-"});
+}
+
+// ffprobe comes with ffmpeg, so it's expected right next to it, with ffmpeg in the name replaced
+static std::string ffprobePath(const std::string& ffmpeg) {
+    size_t name = ffmpeg.find_last_of("/\\");
+    name = name == std::string::npos ? 0 : name + 1;
+    size_t pos = ffmpeg.find("ffmpeg", name);
+    if (pos == std::string::npos) {
+        return ffmpeg.substr(0, name) + "ffprobe";
+    }
+    return ffmpeg.substr(0, pos) + "ffprobe" + ffmpeg.substr(pos + 6);
+}
+
+int probeAudioChannels(const std::string& ffmpeg, const std::string& path) {
+    FILE* pipe = openPipe({ffprobePath(ffmpeg), "-v", "error", "-select_streams", "a:0", "-show_entries", "stream=channels",
+                           "-of", "csv=p=0", path});
+    if (!pipe) {
+        return -1;
+    }
+
+    // Without an audio stream, nothing gets printed at all
+    std::string output;
+    int c;
+    while ((c = fgetc(pipe)) != EOF) {
+        output += static_cast<char>(c);
+    }
+    if (pclose(pipe) != 0) {
+        return -1;
+    }
+    if (output.find_first_not_of(" \r\n") == std::string::npos) {
+        return 0;
+    }
+    int channels = atoi(output.c_str());
+    return channels > 0 ? channels : -1;
+}
+
+FILE* startAudioDecoder(const std::string& ffmpeg, const std::string& path, int rate) {
+    return openPipe({ffmpeg, "-v", "error", "-nostdin", "-i", path, "-vn", "-ac", "2", "-ar", std::to_string(rate),
+                     "-f", "s16le", "-"});
+}
+
+bool closeDecoder(FILE* pipe) {
+    return pclose(pipe) == 0;
+}
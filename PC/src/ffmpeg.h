@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Runs ffmpeg and reads everything it decodes straight from pipes, so neither images nor audio have to be written to disk
+
+// Starts ffmpeg decoding the video of path into a YUV4MPEG2 stream with 8 bit grayscale frames at the original size.
+// Returns the pipe the stream comes out of, or nullptr if ffmpeg can't be started
+FILE* startVideoDecoder(const std::string& ffmpeg, const std::string& path);
+
+// Asks ffprobe (next to ffmpeg) how many channels the first audio stream of path has. Returns 0 if there's no audio
+// stream, and -1 if ffprobe can't be started or fails
+int probeAudioChannels(const std::string& ffmpeg, const std::string& path);
+
+// Starts ffmpeg decoding the audio of path into interleaved 16 bit stereo samples at rate. Returns the pipe they come out
+// of, or nullptr if ffmpeg can't be started. Only works if path has an audio stream
+FILE* startAudioDecoder(const std::string& ffmpeg, const std::string& path, int rate);
+
+// Waits for a decoder started with startVideoDecoder or startAudioDecoder to exit. Returns false if it failed
+bool closeDecoder(FILE* pipe);
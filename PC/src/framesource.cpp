@@ -0,0 +1,356 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+#include "framesource.h"
+#include "ffmpeg.h"
+
+MappedFile::~MappedFile() {
+#ifdef _WIN32
+    if (mapping) {
+        UnmapViewOfFile(mapping);
+    }
+    if (mappingHandle) {
+        CloseHandle(mappingHandle);
+    }
+    if (file) {
+        CloseHandle(file);
+    }
+#else
+    if (mapping) {
+        munmap(const_cast<uint8_t*>(mapping), length);
+    }
+#endif
+}
+
+bool MappedFile::open(const std::string& path) {
+#ifdef _WIN32
+    file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        file = nullptr;
+        return false;
+    }
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize)) {
+        return false;
+    }
+    length = static_cast<size_t>(fileSize.QuadPart);
+    if (length == 0) {
+        return true;
+    }
+
+    mappingHandle = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mappingHandle) {
+        return false;
+    }
+    mapping = static_cast<const uint8_t*>(MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0));
+    return mapping != nullptr;
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        ::close(fd);
+        return false;
+    }
+    length = static_cast<size_t>(info.st_size);
+    if (length == 0) {
+        ::close(fd);
+        return true;
+    }
+
+    // The mapping stays valid after the file gets closed
+    void* address = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (address == MAP_FAILED) {
+        length = 0;
+        return false;
+    }
+    mapping = static_cast<const uint8_t*>(address);
+    madvise(address, length, MADV_SEQUENTIAL);
+    return true;
+#endif
+}
+
+void MappedFile::prefetch(size_t offset, size_t prefetchLength) {
+#ifndef _WIN32
+    if (offset >= length) {
+        return;
+    }
+    size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t start = offset / page * page;
+    size_t end = std::min(length, offset + prefetchLength);
+    madvise(const_cast<uint8_t*>(mapping + start), end - start, MADV_WILLNEED);
+#else
+    (void) offset;
+    (void) prefetchLength;
+#endif
+}
+
+void MappedFile::releaseUpTo(size_t offset) {
+#ifndef _WIN32
+    // Only whole pages in front of offset can go. Pages of a read only mapping just get read again if they're needed
+    size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t end = std::min(offset, length) / page * page;
+    if (end > released) {
+        madvise(const_cast<uint8_t*>(mapping + released), end - released, MADV_DONTNEED);
+        released = end;
+    }
+#else
+    (void) offset;
+#endif
+}
+
+bool PngDirectorySource::open() {
+    std::error_code ec;
+    if (!std::filesystem::is_directory(directory, ec)) {
+        error = "Couldn't find " + directory.string();
+        return false;
+    }
+
+    // The images have to be encoded in the same order every time, otherwise resuming wouldn't work
+    for (auto& p : std::filesystem::directory_iterator(directory)) {
+        if (p.is_regular_file()) {
+            paths.push_back(p.path());
+        }
+    }
+    std::sort(paths.begin(), paths.end());
+    channels = 3;
+    return true;
+}
+
+bool PngDirectorySource::nextFrame() {
+    if (next >= paths.size()) {
+        return false;
+    }
+    next++;
+    return true;
+}
+
+bool PngDirectorySource::readImage(SourceImage& image) {
+    std::ifstream file(paths[next - 1], std::ios::binary);
+    image.index = next - 1;
+    image.data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    if (!file) {
+        error = "Couldn't load " + paths[next - 1].string();
+        return false;
+    }
+    return true;
+}
+
+bool PngDirectorySource::decodeImage(SourceImage& image, std::string& decodeError) const {
+    int bpp;
+    image.decoded = {stbi_load_from_memory(image.data.data(), static_cast<int>(image.data.size()), &image.width, &image.height, &bpp, 3),
+                     stbi_image_free};
+    if (!image.decoded) {
+        decodeError = "Couldn't load " + paths[image.index].string();
+        return false;
+    }
+    image.data = std::vector<uint8_t>();
+    image.pixels = image.decoded.get();
+    image.channels = 3;
+    return true;
+}
+
+bool RawFileSource::open() {
+    if (!file.open(path)) {
+        error = "Couldn't open " + path;
+        return false;
+    }
+
+    frameSize = static_cast<size_t>(width) * height * channels;
+    numFrames = file.size() / frameSize;
+    if (file.size() % frameSize != 0) {
+        error = path + " doesn't consist of whole " + std::to_string(width) + "x" + std::to_string(height) + " images";
+        return false;
+    }
+    return true;
+}
+
+bool RawFileSource::nextFrame() {
+    if (next >= numFrames) {
+        return false;
+    }
+    next++;
+    return true;
+}
+
+bool RawFileSource::readImage(SourceImage& image) {
+    size_t offset = (next - 1) * frameSize;
+    file.prefetch(offset + frameSize, frameSize * prefetchFrames);
+    file.releaseUpTo(offset - std::min<size_t>(offset, frameSize * imagesInFlight));
+
+    image.index = next - 1;
+    image.pixels = file.data() + offset;
+    image.width = width;
+    image.height = height;
+    image.channels = channels;
+    return true;
+}
+
+bool Y4mFileSource::open() {
+    if (!file.open(path)) {
+        error = "Couldn't open " + path;
+        return false;
+    }
+
+    const char* data = reinterpret_cast<const char*>(file.data());
+    size_t size = file.size();
+    const char* lineEnd = data ? static_cast<const char*>(memchr(data, '\n', size)) : nullptr;
+    if (!lineEnd || !parseY4mHeader(std::string(data, lineEnd), format, error)) {
+        error = path + ": " + (error.empty() ? "Not a YUV4MPEG2 stream" : error);
+        return false;
+    }
+
+    // Finding all frames up front only touches the frame headers
+    size_t frameSize = format.lumaSize() + format.chromaSize;
+    for (size_t pos = lineEnd - data + 1; pos < size;) {
+        lineEnd = static_cast<const char*>(memchr(data + pos, '\n', size - pos));
+        if (!lineEnd || !isY4mFrameHeader(data + pos, lineEnd - data - pos)) {
+            error = path + ": Invalid frame header after frame " + std::to_string(frameOffsets.size());
+            return false;
+        }
+
+        pos = lineEnd - data + 1;
+        if (size - pos < frameSize) {
+            error = path + ": Frame " + std::to_string(frameOffsets.size()) + " ends early";
+            return false;
+        }
+        frameOffsets.push_back(pos);
+        pos += frameSize;
+    }
+
+    width = format.width;
+    height = format.height;
+    channels = 1;
+    fpsNum = format.fpsNum;
+    fpsDen = format.fpsDen;
+    return true;
+}
+
+bool Y4mFileSource::nextFrame() {
+    if (next >= frameOffsets.size()) {
+        return false;
+    }
+    next++;
+    return true;
+}
+
+bool Y4mFileSource::readImage(SourceImage& image) {
+    size_t offset = frameOffsets[next - 1];
+    if (next < frameOffsets.size()) {
+        file.prefetch(frameOffsets[next], (frameOffsets[next] - offset) * prefetchFrames);
+    }
+    file.releaseUpTo(frameOffsets[next - 1 - std::min<size_t>(next - 1, imagesInFlight)]);
+
+    image.index = next - 1;
+    image.pixels = file.data() + offset;
+    image.width = width;
+    image.height = height;
+    image.channels = channels;
+    return true;
+}
+
+bool Y4mFileSource::decodeImage(SourceImage& image, std::string& decodeError) const {
+    (void) decodeError;
+    if (format.limitedRange) {
+        image.data.resize(format.lumaSize());
+        expandLumaRange(image.pixels, image.data.data(), image.data.size());
+        image.pixels = image.data.data();
+    }
+    return true;
+}
+
+FfmpegSource::~FfmpegSource() {
+    if (pipe) {
+        closeDecoder(pipe);
+    }
+}
+
+// Reads everything up to the next line break. Returns false at the end of the stream
+static bool readLine(FILE* file, std::string& line) {
+    line.clear();
+    int c;
+    while ((c = fgetc(file)) != EOF && c != '\n') {
+        line.push_back(static_cast<char>(c));
+    }
+    return c == '\n';
+}
+
+bool FfmpegSource::open() {
+    pipe = startVideoDecoder(ffmpeg, path);
+    std::string header;
+    if (!pipe || !readLine(pipe, header) || !parseY4mHeader(header, format, error)) {
+        error = "Couldn't decode " + path + " with ffmpeg" + (error.empty() ? "" : ": " + error);
+        return false;
+    }
+
+    width = format.width;
+    height = format.height;
+    channels = 1;
+    fpsNum = format.fpsNum;
+    fpsDen = format.fpsDen;
+    skipped.resize(format.chromaSize);
+    return true;
+}
+
+bool FfmpegSource::nextFrame() {
+    // Frames have to be read even if they get skipped
+    std::string frameHeader;
+    if (!readLine(pipe, frameHeader) || !isY4mFrameHeader(frameHeader.data(), frameHeader.size())) {
+        return false;
+    }
+
+    luma.resize(format.lumaSize());
+    if (fread(luma.data(), 1, luma.size(), pipe) != luma.size() || fread(skipped.data(), 1, skipped.size(), pipe) != skipped.size()) {
+        error = path + ": Frame ends early";
+        return false;
+    }
+    frameIndex++;
+    return true;
+}
+
+bool FfmpegSource::readImage(SourceImage& image) {
+    // The image takes the luma along, so the next frame gets read into a new buffer
+    image.index = frameIndex - 1;
+    image.data = std::move(luma);
+    luma = std::vector<uint8_t>();
+    image.pixels = image.data.data();
+    image.width = width;
+    image.height = height;
+    image.channels = channels;
+    return true;
+}
+
+bool FfmpegSource::decodeImage(SourceImage& image, std::string& decodeError) const {
+    (void) decodeError;
+    if (format.limitedRange) {
+        expandLumaRange(image.data.data(), image.data.data(), image.data.size());
+    }
+    return true;
+}
+
+bool FfmpegSource::close() {
+    bool success = closeDecoder(pipe);
+    pipe = nullptr;
+    if (!success) {
+        error = "ffmpeg couldn't decode all of " + path;
+    }
+    return success;
+}
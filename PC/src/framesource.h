@@ -0,0 +1,226 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <filesystem>
+#include <memory>
+
+#include "y4m.h"
+
+// Where the encoder gets its images from. Every source hands out one image after the other as RGB or grayscale pixels.
+// Reading an image and decoding it are separate steps, so they can run on different threads
+
+constexpr size_t unknownNumFrames = SIZE_MAX;  // The number of images is only known once the source ends
+constexpr int prefetchFrames = 4;               // Images mapped sources ask the OS to read ahead
+constexpr int imagesInFlight = 16;              // Images behind the one that's read that later stages may still be using
+
+// An image on its way from the source to the encoder. It owns everything its pixels point to, except for the mappings
+// of mapped sources, which stay around for imagesInFlight images
+struct SourceImage {
+    size_t index = 0;                   // Number of the image in the source
+    const uint8_t* pixels = nullptr;    // width * height * channels bytes once it's decoded
+    int width = 0;
+    int height = 0;
+    int channels = 0;
+    std::vector<uint8_t> data;          // What got read, if the pixels couldn't stay where they are
+    std::unique_ptr<uint8_t, void (*)(void*)> decoded{nullptr, free};
+};
+
+class FrameSource {
+public:
+    virtual ~FrameSource() = default;
+
+    // Gets the source ready and finds out everything about it that's known up front
+    virtual bool open() = 0;
+
+    // Moves on to the next image without loading it, so skipped images cost as little as possible. Returns false at the
+    // end of the source, or if it's broken (then getError isn't empty)
+    virtual bool nextFrame() = 0;
+
+    // Reads the current image, but leaves everything that takes a lot of CPU time to decodeImage. Returns false if it
+    // can't be read
+    virtual bool readImage(SourceImage& image) = 0;
+
+    // Turns what readImage got into pixels. It only touches image, so it can run on another thread while the source
+    // reads the next images. Mapped sources point the pixels straight into the file where they can
+    virtual bool decodeImage(SourceImage& image, std::string& decodeError) const {
+        (void) image;
+        (void) decodeError;
+        return true;
+    }
+
+    // Number of images, or unknownNumFrames
+    virtual size_t getNumFrames() const = 0;
+
+    // Stops the source once all images have been read. Returns false if it turned out to be broken
+    virtual bool close() {
+        return true;
+    }
+
+    // Size of the images, or 0 if every image can have its own size
+    int getWidth() const {
+        return width;
+    }
+
+    int getHeight() const {
+        return height;
+    }
+
+    // 3 for RGB, 1 for grayscale
+    int getChannels() const {
+        return channels;
+    }
+
+    // Frame rate as a fraction, or 0 if the source doesn't know it
+    uint32_t getFpsNum() const {
+        return fpsNum;
+    }
+
+    uint32_t getFpsDen() const {
+        return fpsDen;
+    }
+
+    const std::string& getError() const {
+        return error;
+    }
+
+protected:
+    int width = 0;
+    int height = 0;
+    int channels = 0;
+    uint32_t fpsNum = 0;
+    uint32_t fpsDen = 0;
+    std::string error;
+};
+
+// A read only memory mapping of a whole file
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile();
+
+    bool open(const std::string& path);
+
+    // Tells the OS that a part of the file is going to be needed soon
+    void prefetch(size_t offset, size_t prefetchLength);
+
+    // Tells the OS that everything in front of offset isn't needed anymore
+    void releaseUpTo(size_t offset);
+
+    const uint8_t* data() const {
+        return mapping;
+    }
+
+    size_t size() const {
+        return length;
+    }
+
+private:
+    const uint8_t* mapping = nullptr;
+    size_t length = 0;
+    size_t released = 0;        // Everything in front of it has been released
+#ifdef _WIN32
+    void* file = nullptr;
+    void* mappingHandle = nullptr;
+#endif
+};
+
+// Images in a directory (RGB), in the order of their file names
+class PngDirectorySource : public FrameSource {
+public:
+    explicit PngDirectorySource(std::filesystem::path directory) : directory(std::move(directory)) {}
+
+    bool open() override;
+    bool nextFrame() override;
+    bool readImage(SourceImage& image) override;
+    bool decodeImage(SourceImage& image, std::string& decodeError) const override;
+
+    size_t getNumFrames() const override {
+        return paths.size();
+    }
+
+private:
+    std::filesystem::path directory;
+    std::vector<std::filesystem::path> paths;
+    size_t next = 0;
+};
+
+// A file with nothing but images of the same size back to back, either grayscale or RGB
+class RawFileSource : public FrameSource {
+public:
+    RawFileSource(std::string path, int rawWidth, int rawHeight, int rawChannels) : path(std::move(path)) {
+        width = rawWidth;
+        height = rawHeight;
+        channels = rawChannels;
+    }
+
+    bool open() override;
+    bool nextFrame() override;
+    bool readImage(SourceImage& image) override;
+
+    size_t getNumFrames() const override {
+        return numFrames;
+    }
+
+private:
+    std::string path;
+    MappedFile file;
+    size_t frameSize = 0;
+    size_t numFrames = 0;
+    size_t next = 0;
+};
+
+// A YUV4MPEG2 file (grayscale)
+class Y4mFileSource : public FrameSource {
+public:
+    explicit Y4mFileSource(std::string path) : path(std::move(path)) {}
+
+    bool open() override;
+    bool nextFrame() override;
+    bool readImage(SourceImage& image) override;
+    bool decodeImage(SourceImage& image, std::string& decodeError) const override;
+
+    size_t getNumFrames() const override {
+        return frameOffsets.size();
+    }
+
+private:
+    std::string path;
+    MappedFile file;
+    Y4mFormat format;
+    std::vector<size_t> frameOffsets;   // Offset of the luma plane of every frame
+    size_t next = 0;
+};
+
+// A video decoded by ffmpeg, which sends it through a pipe as a YUV4MPEG2 stream (grayscale)
+class FfmpegSource : public FrameSource {
+public:
+    FfmpegSource(std::string ffmpeg, std::string path) : ffmpeg(std::move(ffmpeg)), path(std::move(path)) {}
+    ~FfmpegSource() override;
+
+    bool open() override;
+    bool nextFrame() override;
+    bool readImage(SourceImage& image) override;
+    bool decodeImage(SourceImage& image, std::string& decodeError) const override;
+
+    size_t getNumFrames() const override {
+        return unknownNumFrames;
+    }
+
+    bool close() override;
+
+private:
+    std::string ffmpeg;
+    std::string path;
+    FILE* pipe = nullptr;
+    Y4mFormat format;
+    std::vector<uint8_t> luma;          // Luma of the current frame, until readImage takes it
+    std::vector<uint8_t> skipped;       // Chroma planes of the current frame
+    size_t frameIndex = 0;
+};
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <cstdint>
+
+// Definitions of the .kpv video format shared by the encoder and the decoder
+
+// Frame flags
+#define FLAG_COMPRESSION_STAY            1
+#define FLAG_COMPRESSION_CHARACTERS     (1 << 1)
+#define FLAG_COMPRESSION_LZ77           (1 << 2)
+#define FLAG_DURATION                   (1 << 3)    // A byte with the number of VBlanks the frame stays on screen follows
+#define FLAG_COMPRESSION_VRAM           (1 << 4)    // The LZ77 stream can be decompressed straight into VRAM
+#define FLAG_COMPRESSION_LZ11           (1 << 5)    // The frame uses LZ11 (type 0x11) instead of LZSS (type 0x10)
+#define FLAG_COMPRESSION_DICT           (1 << 6)    // The stream continues from the start of the previous frame buffer
+#define FLAG_EXTENDED                   (1 << 7)    // A byte with the extended flags below follows right after the flags
+
+// Extended frame flags
+#define EXT_FLAG_RESIDUAL               1           // The frame buffer has to be XORed with the previous one of the plane
+#define EXT_FLAG_SPLIT                  (1 << 1)    // The map bytes and the characters are stored as separate streams
+#define EXT_FLAG_BILEVEL                (1 << 2)    // Characters with only two values are packed into 1 bit per pixel
+#define EXT_FLAG_4BPP                   (1 << 3)    // The characters use 4 bits per pixel and a palette bank each
+#define EXT_FLAG_SCROLL                 (1 << 4)    // Two bytes with the BG scroll offset follow the extended flags
+#define EXT_FLAG_METATILE               (1 << 5)    // The map is stored as a map of 2x2 blocks of map entries
+#define EXT_FLAG_REFERENCE              (1 << 6)    // A STAY frame that shows the frame buffer of a reference slot again
+#define EXT_FLAG_KEEP                   (1 << 7)    // The frame buffer gets copied into a reference slot after decoding
+
+// Video flags (stored in the file header)
+#define VIDEO_FLAG_DUAL_SCREEN          1       // Every frame consists of a top and a bottom screen plane
+#define VIDEO_FLAG_SOLID_TILES          (1 << 1)    // The last characters of every BG buffer are a solid tile per brightness level
+#define VIDEO_FLAG_AUDIO_BLOCK_TYPES    (1 << 2)    // Every audio block starts with a byte that tells how it's stored
+#define VIDEO_FLAG_MONO                 (1 << 3)    // Every audio block is mono or silent, so both speakers can play the same buffer
+#define VIDEO_REFERENCE_SLOTS_SHIFT     8           // Bits 8-11 hold the number of reference slots of every plane
+#define VIDEO_AUDIO_BLOCK_SHIFT         16          // Bits 16-31 hold the number of samples per audio block, 0 means sampleSize
+
+// Audio block types
+#define AUDIO_BLOCK_PCM                 0           // The left channel followed by the right channel
+#define AUDIO_BLOCK_SILENCE             1           // Nothing follows, the whole block is silent
+#define AUDIO_BLOCK_MONO                2           // A single channel for both speakers
+
+// DS Screen data
+constexpr int imgWidth = 256;
+constexpr int imgHeight = 192;
+constexpr int tileWidth = 8;
+constexpr int tileHeight = 8;
+constexpr int maxPlanes = 2;    // One plane per screen
+
+// Layout of a frame in VRAM. The characters start right after the map, so the first tile index is 0x18
+constexpr int mapSize = (imgWidth / tileWidth) * (imgHeight / tileHeight);  // Number of map entries
+constexpr int tileSize = tileWidth * tileHeight;                            // Bytes per character
+constexpr int tileOffset = mapSize * 2 / tileSize;                          // Index of the first character
+constexpr int frameBufferSize = 0xC000;                                     // Size of a frame buffer on the DS
+constexpr int maxTiles = frameBufferSize / tileSize - tileOffset;           // Number of characters that fit into a frame buffer
+
+// With VIDEO_FLAG_SOLID_TILES, the DS fills the last numLevels characters of every BG buffer with solid tiles once, and
+// the map points solid tiles straight at solidTileBase + level. Frames have to stop right in front of them
+constexpr int numLevels = 32;
+constexpr int solidTileBase = frameBufferSize / tileSize - numLevels;
+constexpr int maxTilesWithBank = solidTileBase - tileOffset;                // Number of characters that fit in front of the bank
+
+// A FLAG_COMPRESSION_DICT frame gets decompressed as if the first dictSize bytes of the previous frame buffer of the
+// plane (filled up with 0s) were right in front of it. That's as much as CUE's LZSS window can reach, and every byte
+// ends up exactly one window behind the byte at the same position in the new frame
+constexpr int dictSize = 0x1000 - 0x12;
+
+// An EXT_FLAG_RESIDUAL frame stores the XOR of the new frame buffer with the previous one (filled up with 0s), so
+// everything that didn't change becomes 0
+
+// An EXT_FLAG_SPLIT frame consists of the 16 bit sizes of the first two streams, followed by a stream with the high bytes
+// of the map, a stream with the low bytes of the map and a stream with the characters. The sizes of the first two
+// streams are padded to a multiple of 4, so every stream starts word aligned
+constexpr int splitHeaderSize = 4;
+
+// In an EXT_FLAG_BILEVEL frame, the map is followed by the 16 bit number of characters and a bit per character (LSB
+// first) that tells if it's packed. A packed character consists of its two values and a mask byte per row, where bit x
+// picks the second value for pixel x. Every other character is stored as usual. Split frames pack the character stream
+constexpr int bilevelTileSize = 2 + tileHeight;
+
+// EXT_FLAG_4BPP frames store two pixels per byte (left pixel in the low nibble), and bits 12-15 of every map entry pick
+// one of 16 palette banks. Color 0 is transparent and shows the backdrop, which is level 0, so every bank only covers
+// 15 more levels starting at paletteBankStart. Banks 0 and 1 match the 8bpp palette. A frame with a character that
+// doesn't fit into any bank (more than 15 levels besides 0, or 16 and 30 without anything below 16) is stored in 8bpp
+// instead. 4bpp frames don't use the solid tile bank, since it's out of reach of 4bpp tile indices
+constexpr int tileSize4bpp = tileSize / 2;
+constexpr int tileOffset4bpp = mapSize * 2 / tileSize4bpp;
+constexpr int numPaletteBanks = 16;
+constexpr int paletteBankLevels = 15;
+
+constexpr int paletteBankStart(int bank) {
+    return bank == 0 ? 1 : (bank == 1 ? 17 : bank);
+}
+
+// An EXT_FLAG_SCROLL frame is shown with the BG scrolled by scrollX (0-255) and scrollY (0-maxScrollY) pixels, which stay
+// until the next frame that isn't a STAY frame. The BG wraps around horizontally, so scrolling keeps characters on the
+// same map column while the image moves. The lowest scrollY lines come from a 25th map row, so the characters start one
+// tile later. Every other frame is shown unscrolled
+constexpr int maxScrollY = tileHeight - 1;
+constexpr int scrollMapSize = mapSize + imgWidth / tileWidth;
+constexpr int scrollTileOffset = scrollMapSize * 2 / tileSize;
+
+// In an EXT_FLAG_METATILE frame, the map is replaced by the 16 bit number of metatiles, the metatiles with 4 map entries
+// each (top left, top right, bottom left, bottom right) and a byte per 16x16 pixel block of the screen that picks its
+// metatile. The characters follow as usual. Metatile frames are never residuals, split, packed or scrolled
+constexpr int metatileEntries = 4;
+constexpr int metatileMapSize = (imgWidth / tileWidth / 2) * (imgHeight / tileHeight / 2);
+
+// With reference slots, the byte of the slot follows the scroll offset of EXT_FLAG_REFERENCE and EXT_FLAG_KEEP frames. A
+// slot keeps the frame buffer along with its 4bpp mode and scroll offset, and a reference frame takes over all of them, so
+// the next frame refers to it like to any other frame
+constexpr int maxReferenceSlots = 8;
+
+constexpr int referenceSlots(uint32_t videoFlags) {
+    return (videoFlags >> VIDEO_REFERENCE_SLOTS_SHIFT) & 0xF;
+}
+
+constexpr int headerSize = 8;           // Number of frames and video flags
+constexpr int sampleSize = 3200;        // Samples per audio block at 48000 Hz, and the most a block can have
+constexpr int ticksPerAudioBlock = 4;   // An audio block is played during 4 VBlanks
+constexpr int silenceThreshold = 8;     // Loudest sample a block can have and still be stored as silence
+constexpr int monoThreshold = 4;        // Largest difference between the channels a block can have and still be stored as mono
+constexpr int preloadBlocks = 12;       // Audio blocks in front of the first frame
+constexpr int displayRate = 60;         // VBlanks per second
+constexpr int maxDuration = 255;        // Longest duration that fits into the duration byte
+
+// Every audio block lasts ticksPerAudioBlock VBlanks, so the sample rate follows from the number of samples per block
+constexpr int audioBlockSamples(uint32_t videoFlags) {
+    int numSamples = static_cast<int>(videoFlags >> VIDEO_AUDIO_BLOCK_SHIFT);
+    return numSamples ? numSamples : sampleSize;
+}
+
+constexpr int audioRate(int blockSamples) {
+    return blockSamples * displayRate / ticksPerAudioBlock;
+}
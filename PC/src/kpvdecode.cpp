@@ -0,0 +1,596 @@
+#include <fstream>
+#include <iterator>
+#include <chrono>
+#include <algorithm>
+
+#include "kpvdecode.h"
+
+bool lzDecompress(const uint8_t* src, size_t srcSize, std::vector<uint8_t>& dst, bool vram, std::string& error,
+                  const uint8_t* dict, size_t dictLength) {
+    if (srcSize < 4 || (src[0] != 0x10 && src[0] != 0x11)) {
+        error = "Not an LZ77 stream";
+        return false;
+    }
+
+    bool lz11 = src[0] == 0x11;
+
+    // The dictionary goes right in front of the output, so matches can simply point into it
+    size_t rawSize = (src[1] | (src[2] << 8) | (src[3] << 16)) + dictLength;
+    size_t pos = 4;
+    dst.clear();
+    dst.reserve(rawSize);
+    if (dictLength) {
+        dst.assign(dict, dict + dictLength);
+    }
+
+    while (dst.size() < rawSize) {
+        if (pos >= srcSize) {
+            error = "LZ77 stream ends early";
+            return false;
+        }
+
+        uint8_t flags = src[pos++];
+        for (int i = 0; i < 8 && dst.size() < rawSize; i++, flags <<= 1) {
+            if (!(flags & 0x80)) {
+                if (pos >= srcSize) {
+                    error = "LZ77 stream ends early";
+                    return false;
+                }
+                dst.push_back(src[pos++]);
+                continue;
+            }
+
+            // LZ11 uses the upper 4 bits of the first byte to tell how long the length is
+            size_t tokenSize = 2;
+            if (lz11 && (src[pos] >> 4) == 0) {
+                tokenSize = 3;
+            } else if (lz11 && (src[pos] >> 4) == 1) {
+                tokenSize = 4;
+            }
+
+            if (pos + tokenSize > srcSize) {
+                error = "LZ77 stream ends early";
+                return false;
+            }
+
+            size_t length;
+            if (!lz11) {
+                length = (src[pos] >> 4) + 3;
+            } else if (tokenSize == 2) {
+                length = (src[pos] >> 4) + 1;
+            } else if (tokenSize == 3) {
+                length = (((src[pos] & 0xF) << 4) | (src[pos + 1] >> 4)) + 0x11;
+            } else {
+                length = (((src[pos] & 0xF) << 12) | (src[pos + 1] << 4) | (src[pos + 2] >> 4)) + 0x111;
+            }
+
+            size_t distance = (((src[pos + tokenSize - 2] & 0xF) << 8) | src[pos + tokenSize - 1]) + 1;
+            pos += tokenSize;
+
+            if (distance > dst.size()) {
+                error = "LZ77 match points in front of the output";
+                return false;
+            }
+
+            // The VRAM function writes 16 bits at once, so the byte right in front of the current one isn't there yet
+            if (vram && distance == 1) {
+                error = "LZ77 stream isn't VRAM safe";
+                return false;
+            }
+
+            for (size_t j = 0; j < length && dst.size() < rawSize; j++) {
+                dst.push_back(dst[dst.size() - distance]);
+            }
+        }
+    }
+
+    dst.erase(dst.begin(), dst.begin() + dictLength);
+    return true;
+}
+
+KpvDecoder::KpvDecoder(uint32_t videoFlags) : videoFlags(videoFlags) {
+    for (auto& bgBuffer : bgBuffers) {
+        bgBuffer.assign(frameBufferSize, 0);
+
+        // The DS sets up the solid tile bank once at the start
+        if (videoFlags & VIDEO_FLAG_SOLID_TILES) {
+            for (int level = 0; level < numLevels; level++) {
+                std::fill_n(bgBuffer.begin() + (solidTileBase + level) * tileSize, tileSize, level);
+            }
+        }
+    }
+    for (auto& lastBuffer : lastBuffers) {
+        lastBuffer.assign(frameBufferSize, 0);
+    }
+}
+
+size_t KpvDecoder::decodePlane(int plane, const uint8_t* data, size_t size) {
+    size_t pos = 0;
+
+    if (plane >= ((videoFlags & VIDEO_FLAG_DUAL_SCREEN) ? 2 : 1)) {
+        error = "Invalid plane";
+        return 0;
+    }
+
+    if (size < 1) {
+        error = "Frame ends early";
+        return 0;
+    }
+
+    flags = data[pos++];
+    extFlags = 0;
+    duration = 1;
+
+    if (flags & FLAG_EXTENDED) {
+        if (pos >= size) {
+            error = "Frame ends early";
+            return 0;
+        }
+        extFlags = data[pos++];
+    }
+
+    uint8_t newScroll[2] = {};
+    if (extFlags & EXT_FLAG_SCROLL) {
+        if (pos + 2 > size) {
+            error = "Frame ends early";
+            return 0;
+        }
+        newScroll[0] = data[pos++];
+        newScroll[1] = data[pos++];
+        if (newScroll[1] > maxScrollY) {
+            error = "Frame is scrolled too far down";
+            return 0;
+        }
+    }
+
+    uint8_t slot = 0;
+    if (extFlags & (EXT_FLAG_REFERENCE | EXT_FLAG_KEEP)) {
+        if (pos >= size) {
+            error = "Frame ends early";
+            return 0;
+        }
+        slot = data[pos++];
+        if (slot >= referenceSlots(videoFlags)) {
+            error = "Invalid reference slot";
+            return 0;
+        }
+    }
+
+    // Only STAY frames can be shown from a reference slot, and only new frames can be kept
+    if ((extFlags & EXT_FLAG_REFERENCE) && (!(flags & FLAG_COMPRESSION_STAY) || (extFlags & EXT_FLAG_KEEP))) {
+        error = "Reference frame isn't a STAY frame";
+        return 0;
+    }
+    if ((extFlags & EXT_FLAG_KEEP) && (flags & FLAG_COMPRESSION_STAY)) {
+        error = "STAY frame can't be kept";
+        return 0;
+    }
+
+    if (flags & FLAG_DURATION) {
+        if (pos >= size) {
+            error = "Frame ends early";
+            return 0;
+        }
+        duration = data[pos++];
+        if (duration == 0) {
+            error = "Frame with a duration of 0";
+            return 0;
+        }
+    }
+
+    if (flags & (FLAG_COMPRESSION_LZ77 | FLAG_COMPRESSION_CHARACTERS)) {
+        if (pos + 2 > size) {
+            error = "Frame ends early";
+            return 0;
+        }
+
+        size_t blockLength = data[pos] | (data[pos + 1] << 8);
+        pos += 2;
+
+        if (pos + blockLength > size) {
+            error = "Frame ends early";
+            return 0;
+        }
+
+        // VRAM frames are decompressed straight into a BG buffer, so the DS has neither a dictionary nor the previous frame at hand
+        if (((flags & FLAG_COMPRESSION_DICT) || (extFlags & (EXT_FLAG_RESIDUAL | EXT_FLAG_SPLIT))) && (flags & FLAG_COMPRESSION_VRAM)) {
+            error = "VRAM frame needs to be decompressed into RAM";
+            return 0;
+        }
+
+        if ((extFlags & EXT_FLAG_SPLIT) && (flags & FLAG_COMPRESSION_DICT)) {
+            error = "Split frame uses a dictionary";
+            return 0;
+        }
+        if ((extFlags & EXT_FLAG_BILEVEL) && (extFlags & (EXT_FLAG_RESIDUAL | EXT_FLAG_4BPP))) {
+            error = "Packed frame is a residual or 4bpp";
+            return 0;
+        }
+        if ((extFlags & EXT_FLAG_METATILE) && (extFlags & (EXT_FLAG_RESIDUAL | EXT_FLAG_SPLIT | EXT_FLAG_BILEVEL | EXT_FLAG_SCROLL))) {
+            error = "Metatile frame is a residual, split, packed or scrolled";
+            return 0;
+        }
+
+        if (extFlags & EXT_FLAG_SPLIT) {
+            if (!decompressSplit(&data[pos], blockLength)) {
+                return 0;
+            }
+        } else {
+            const uint8_t* dict = (flags & FLAG_COMPRESSION_DICT) ? lastBuffers[plane].data() : nullptr;
+            if (!decompressStream(&data[pos], blockLength, decompressed, dict)) {
+                return 0;
+            }
+        }
+        pos += blockLength;
+
+        if ((extFlags & EXT_FLAG_BILEVEL) && !expandBilevel()) {
+            return 0;
+        }
+        if ((extFlags & EXT_FLAG_METATILE) && !expandMetatiles()) {
+            return 0;
+        }
+
+        // The DS only copies frameBufferSize bytes into VRAM
+        if (decompressed.size() > frameBufferSize) {
+            error = "Frame doesn't fit into a frame buffer";
+            return 0;
+        }
+        if ((videoFlags & VIDEO_FLAG_SOLID_TILES) && decompressed.size() > solidTileBase * tileSize) {
+            error = "Frame overwrites the solid tile bank";
+            return 0;
+        }
+        if (decompressed.size() < static_cast<size_t>((extFlags & EXT_FLAG_SCROLL) ? scrollMapSize : mapSize) * 2) {
+            error = "Frame is missing its map";
+            return 0;
+        }
+
+        if (extFlags & EXT_FLAG_RESIDUAL) {
+            for (size_t i = 0; i < decompressed.size(); i++) {
+                decompressed[i] ^= lastBuffers[plane][i];
+            }
+        }
+
+        std::copy(decompressed.begin(), decompressed.end(), bgBuffers[plane].begin());
+        is4bpp[plane] = extFlags & EXT_FLAG_4BPP;
+        scroll[plane][0] = newScroll[0];
+        scroll[plane][1] = newScroll[1];
+
+        // The next frame can refer to this one
+        std::fill(lastBuffers[plane].begin(), lastBuffers[plane].end(), 0);
+        std::copy(decompressed.begin(), decompressed.end(), lastBuffers[plane].begin());
+
+        if (extFlags & EXT_FLAG_KEEP) {
+            Reference& reference = references[plane][slot];
+            reference.buffer = decompressed;
+            reference.is4bpp = is4bpp[plane];
+            reference.scroll[0] = scroll[plane][0];
+            reference.scroll[1] = scroll[plane][1];
+        }
+    } else if ((flags & FLAG_COMPRESSION_STAY) && (extFlags & EXT_FLAG_REFERENCE)) {
+        const Reference& reference = references[plane][slot];
+        if (reference.buffer.empty()) {
+            error = "Reference slot is empty";
+            return 0;
+        }
+
+        // The frame takes the place of a newly decoded one
+        std::copy(reference.buffer.begin(), reference.buffer.end(), bgBuffers[plane].begin());
+        std::fill(lastBuffers[plane].begin(), lastBuffers[plane].end(), 0);
+        std::copy(reference.buffer.begin(), reference.buffer.end(), lastBuffers[plane].begin());
+        is4bpp[plane] = reference.is4bpp;
+        scroll[plane][0] = reference.scroll[0];
+        scroll[plane][1] = reference.scroll[1];
+    } else if (!(flags & FLAG_COMPRESSION_STAY)) {
+        error = "Invalid flag byte";
+        return 0;
+    }
+
+    return pos;
+}
+
+bool KpvDecoder::decompressStream(const uint8_t* src, size_t srcSize, std::vector<uint8_t>& dst, const uint8_t* dict) {
+    // The flag has to match the stream, since the DS uses it to pick the decompressor
+    if (srcSize < 1 || (src[0] == 0x11) != ((flags & FLAG_COMPRESSION_LZ11) != 0)) {
+        error = "LZ11 flag doesn't match the stream";
+        return false;
+    }
+
+    return lzDecompress(src, srcSize, dst, flags & FLAG_COMPRESSION_VRAM, error, dict, dict ? dictSize : 0);
+}
+
+bool KpvDecoder::decompressSplit(const uint8_t* src, size_t srcSize) {
+    if (srcSize < splitHeaderSize) {
+        error = "Split frame ends early";
+        return false;
+    }
+
+    // The two map streams come first, each padded to a multiple of 4
+    size_t pos = splitHeaderSize;
+    std::vector<uint8_t> planes[2];
+    for (int i = 0; i < 2; i++) {
+        size_t length = src[i * 2] | (src[i * 2 + 1] << 8);
+        if (length % 4 != 0 || pos + length > srcSize) {
+            error = "Invalid split frame header";
+            return false;
+        }
+        if (!decompressStream(&src[pos], length, planes[i], nullptr)) {
+            return false;
+        }
+        if (planes[i].size() != mapSize) {
+            error = "Map stream has the wrong size";
+            return false;
+        }
+        pos += length;
+    }
+
+    std::vector<uint8_t> characters;
+    if (!decompressStream(&src[pos], srcSize - pos, characters, nullptr)) {
+        return false;
+    }
+
+    // Put the map back together, followed by the characters
+    decompressed.resize(mapSize * 2);
+    for (int i = 0; i < mapSize; i++) {
+        decompressed[i * 2] = planes[1][i];
+        decompressed[i * 2 + 1] = planes[0][i];
+    }
+    decompressed.insert(decompressed.end(), characters.begin(), characters.end());
+    return true;
+}
+
+bool KpvDecoder::expandBilevel() {
+    // The DS decompresses the packed frame into a spare frame buffer
+    if (decompressed.size() > frameBufferSize || decompressed.size() < mapSize * 2 + 2) {
+        error = "Packed frame has an invalid size";
+        return false;
+    }
+
+    size_t numTiles = decompressed[mapSize * 2] | (decompressed[mapSize * 2 + 1] << 8);
+    size_t classes = mapSize * 2 + 2;
+    size_t pos = classes + (numTiles + 7) / 8;
+    std::vector<uint8_t> expanded(decompressed.begin(), decompressed.begin() + mapSize * 2);
+
+    for (size_t i = 0; i < numTiles; i++) {
+        if (pos > decompressed.size()) {
+            error = "Packed frame ends early";
+            return false;
+        }
+
+        if (!(decompressed[classes + i / 8] & (1 << (i % 8)))) {
+            if (pos + tileSize > decompressed.size()) {
+                error = "Packed frame ends early";
+                return false;
+            }
+            expanded.insert(expanded.end(), &decompressed[pos], &decompressed[pos] + tileSize);
+            pos += tileSize;
+            continue;
+        }
+
+        if (pos + bilevelTileSize > decompressed.size()) {
+            error = "Packed frame ends early";
+            return false;
+        }
+        for (int y = 0; y < tileHeight; y++) {
+            uint8_t mask = decompressed[pos + 2 + y];
+            for (int x = 0; x < tileWidth; x++) {
+                expanded.push_back(decompressed[pos + ((mask >> x) & 1)]);
+            }
+        }
+        pos += bilevelTileSize;
+    }
+
+    decompressed = expanded;
+    return true;
+}
+
+bool KpvDecoder::expandMetatiles() {
+    // The DS decompresses the metatiles into a spare frame buffer
+    if (decompressed.size() > frameBufferSize || decompressed.size() < 2) {
+        error = "Metatile frame has an invalid size";
+        return false;
+    }
+
+    size_t numMetatiles = decompressed[0] | (decompressed[1] << 8);
+    size_t metatileMap = 2 + numMetatiles * metatileEntries * 2;
+    if (numMetatiles > metatileMapSize || metatileMap + metatileMapSize > decompressed.size()) {
+        error = "Metatile frame ends early";
+        return false;
+    }
+
+    std::vector<uint8_t> expanded(mapSize * 2);
+    for (int i = 0; i < metatileMapSize; i++) {
+        size_t metatile = decompressed[metatileMap + i];
+        if (metatile >= numMetatiles) {
+            error = "Metatile map points outside of the metatiles";
+            return false;
+        }
+
+        int entry = (i / (imgWidth / tileWidth / 2)) * 2 * (imgWidth / tileWidth) + (i % (imgWidth / tileWidth / 2)) * 2;
+        int entries[metatileEntries] = {entry, entry + 1, entry + imgWidth / tileWidth, entry + imgWidth / tileWidth + 1};
+        for (int j = 0; j < metatileEntries; j++) {
+            expanded[entries[j] * 2] = decompressed[2 + (metatile * metatileEntries + j) * 2];
+            expanded[entries[j] * 2 + 1] = decompressed[2 + (metatile * metatileEntries + j) * 2 + 1];
+        }
+    }
+
+    expanded.insert(expanded.end(), decompressed.begin() + metatileMap + metatileMapSize, decompressed.end());
+    decompressed = expanded;
+    return true;
+}
+
+bool KpvDecoder::render(int plane, uint8_t* img) {
+    const uint8_t* bgBuffer = bgBuffers[plane].data();
+
+    // The BG wraps around horizontally
+    for (int y = 0; y < imgHeight; y++) {
+        for (int x = 0; x < imgWidth; x++) {
+            int bgX = (x + scroll[plane][0]) % imgWidth;
+            int bgY = y + scroll[plane][1];
+            int entry = (bgY / tileHeight) * (imgWidth / tileWidth) + bgX / tileWidth;
+            int pixel = (bgY % tileHeight) * tileWidth + bgX % tileWidth;
+            uint16_t mapEntry = bgBuffer[entry * 2] | (bgBuffer[entry * 2 + 1] << 8);
+            uint16_t tile = mapEntry & 0x3FF;
+
+            if ((tile + 1) * (is4bpp[plane] ? tileSize4bpp : tileSize) > frameBufferSize) {
+                error = "Map points outside of the frame buffer";
+                return false;
+            }
+
+            // Color 0 shows the backdrop, every other color picks a level from the palette bank
+            if (is4bpp[plane]) {
+                uint8_t color = (bgBuffer[tile * tileSize4bpp + pixel / 2] >> ((pixel % 2) * 4)) & 0xF;
+                img[y * imgWidth + x] = color ? paletteBankStart(mapEntry >> 12) + color - 1 : 0;
+            } else {
+                img[y * imgWidth + x] = bgBuffer[tile * tileSize + pixel] & 0x1F;
+            }
+        }
+    }
+    return true;
+}
+
+bool KpvReader::open(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+
+    if (!file) {
+        error = "Couldn't open " + path;
+        return false;
+    }
+
+    data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+
+    if (data.size() < headerSize) {
+        error = "File is too small";
+        return false;
+    }
+
+    numFrames = data[0] | (data[1] << 8) | (data[2] << 16) | (data[3] << 24);
+    videoFlags = data[4] | (data[5] << 8) | (data[6] << 16) | (data[7] << 24);
+    pos = headerSize;
+    decoder = KpvDecoder(videoFlags);
+
+    // The DS keeps every audio block in a buffer of sampleSize samples
+    if (audioBlockSamples(videoFlags) > sampleSize) {
+        error = "Audio blocks are too long";
+        return false;
+    }
+
+    for (int i = 0; i < preloadBlocks; i++) {
+        if (!readAudioBlock()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool KpvReader::readAudioBlock() {
+    size_t channelSize = audioBlockSamples(videoFlags) * 2;
+    size_t blockSize = channelSize * 2;
+    uint8_t type = AUDIO_BLOCK_PCM;
+
+    if (videoFlags & VIDEO_FLAG_AUDIO_BLOCK_TYPES) {
+        if (pos >= data.size()) {
+            error = "Audio block ends early";
+            return false;
+        }
+        type = data[pos];
+        if (type == AUDIO_BLOCK_SILENCE) {
+            blockSize = 1;
+            stats.silentBlocks++;
+        } else if (type == AUDIO_BLOCK_MONO) {
+            blockSize = 1 + channelSize;
+            stats.monoBlocks++;
+        } else if (type == AUDIO_BLOCK_PCM && !(videoFlags & VIDEO_FLAG_MONO)) {
+            blockSize++;
+        } else {
+            error = "Invalid audio block type";
+            return false;
+        }
+    }
+
+    if (pos + blockSize > data.size()) {
+        error = "Audio block ends early";
+        return false;
+    }
+
+    pos += blockSize;
+    stats.audioBytes += blockSize;
+    stats.audioBlocks++;
+    return true;
+}
+
+bool KpvReader::readFrame() {
+    if (framesRead >= numFrames) {
+        error = "No frames left";
+        return false;
+    }
+
+    // The audio blocks in front of a frame cover everything up to the VBlank it gets shown at
+    while (audioBlocks * ticksPerAudioBlock <= stats.ticks) {
+        if (!readAudioBlock()) {
+            return false;
+        }
+        audioBlocks++;
+    }
+
+    uint8_t duration = 1;
+    for (int plane = 0; plane < getNumPlanes(); plane++) {
+        auto start = std::chrono::steady_clock::now();
+        size_t used = decoder.decodePlane(plane, &data[pos], data.size() - pos);
+        auto time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+        if (!used) {
+            error = "Frame " + std::to_string(framesRead) + ": " + decoder.getError();
+            return false;
+        }
+
+        // Only the first plane carries the duration
+        if (plane == 0) {
+            duration = decoder.getDuration();
+        }
+
+        stats.planes++;
+        stats.videoBytes += used;
+        if (decoder.getFlags() & FLAG_COMPRESSION_STAY) {
+            stats.stayPlanes++;
+        } else if (decoder.getFlags() & FLAG_COMPRESSION_LZ11) {
+            stats.lz11Planes++;
+            stats.lz11Bytes += decoder.getDecompressedSize();
+            stats.lz11Time += time;
+        } else {
+            stats.lz10Bytes += decoder.getDecompressedSize();
+            stats.lz10Time += time;
+        }
+        if (decoder.getFlags() & FLAG_COMPRESSION_VRAM) {
+            stats.vramPlanes++;
+        }
+        if (decoder.getFlags() & FLAG_COMPRESSION_DICT) {
+            stats.dictPlanes++;
+        }
+        if (decoder.getExtFlags() & EXT_FLAG_RESIDUAL) {
+            stats.residualPlanes++;
+        }
+        if (decoder.getExtFlags() & EXT_FLAG_SPLIT) {
+            stats.splitPlanes++;
+        }
+        if (decoder.getExtFlags() & EXT_FLAG_BILEVEL) {
+            stats.bilevelPlanes++;
+        }
+        if (decoder.getExtFlags() & EXT_FLAG_4BPP) {
+            stats.planes4bpp++;
+        }
+        if (decoder.getExtFlags() & EXT_FLAG_SCROLL) {
+            stats.scrollPlanes++;
+        }
+        if (decoder.getExtFlags() & EXT_FLAG_METATILE) {
+            stats.metatilePlanes++;
+        }
+        if (decoder.getExtFlags() & EXT_FLAG_REFERENCE) {
+            stats.referencePlanes++;
+        }
+        pos += used;
+    }
+
+    stats.ticks += duration;
+    framesRead++;
+    return true;
+}
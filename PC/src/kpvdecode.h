@@ -0,0 +1,153 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "kpv.h"
+
+// Host side decoder for .kpv videos. It does exactly what the DS player does, but checks every step along the way
+
+// Decompresses an LZ77 (type 0x10) or LZ11 (type 0x11) stream. If vram is set, it also makes sure the stream only uses matches the BIOS'
+// VRAM function can handle. If dict is set, matches can reach back into the dictLength bytes in front of the output.
+// Returns false and sets error if the stream is broken
+bool lzDecompress(const uint8_t* src, size_t srcSize, std::vector<uint8_t>& dst, bool vram, std::string& error,
+                  const uint8_t* dict = nullptr, size_t dictLength = 0);
+
+// Keeps the BG buffers of all planes, just like they are stored in VRAM
+class KpvDecoder {
+public:
+    explicit KpvDecoder(uint32_t videoFlags);
+
+    // Decodes the record of one plane starting at its flag byte. Returns the number of bytes it took up or 0 if it's invalid
+    size_t decodePlane(int plane, const uint8_t* data, size_t size);
+
+    // Converts the BG buffer of a plane into brightness levels, just like the DS would display it
+    bool render(int plane, uint8_t* img);
+
+    uint8_t getFlags() const {
+        return flags;
+    }
+
+    uint8_t getExtFlags() const {
+        return extFlags;
+    }
+
+    uint8_t getDuration() const {
+        return duration;
+    }
+
+    size_t getDecompressedSize() const {
+        return decompressed.size();
+    }
+
+    const std::string& getError() const {
+        return error;
+    }
+
+private:
+    // Decompresses one stream of the frame, after checking that it matches the flags
+    bool decompressStream(const uint8_t* src, size_t srcSize, std::vector<uint8_t>& dst, const uint8_t* dict);
+
+    // Decompresses the three streams of an EXT_FLAG_SPLIT frame and puts the frame buffer back together
+    bool decompressSplit(const uint8_t* src, size_t srcSize);
+
+    // Unpacks the two-tone characters of an EXT_FLAG_BILEVEL frame
+    bool expandBilevel();
+
+    // Expands the metatile map of an EXT_FLAG_METATILE frame into a regular map
+    bool expandMetatiles();
+
+    uint32_t videoFlags;
+    std::vector<uint8_t> bgBuffers[maxPlanes];  // Map followed by the characters
+    std::vector<uint8_t> lastBuffers[maxPlanes];    // Last frame buffer of every plane, filled up with 0s
+    bool is4bpp[maxPlanes] = {};                    // If the BG buffer of a plane holds 4bpp characters
+    uint8_t scroll[maxPlanes][2] = {};              // BG scroll offset of every plane
+
+    // Frames the DS keeps in the reference slots of every plane
+    struct Reference {
+        std::vector<uint8_t> buffer;                // Empty as long as the slot isn't used
+        bool is4bpp = false;
+        uint8_t scroll[2] = {};
+    };
+    Reference references[maxPlanes][maxReferenceSlots];
+    std::vector<uint8_t> decompressed;
+    uint8_t flags = 0;
+    uint8_t extFlags = 0;
+    uint8_t duration = 1;
+    std::string error;
+};
+
+// Statistics about a decoded video
+struct KpvStats {
+    uint32_t planes = 0;            // Number of plane records
+    uint32_t stayPlanes = 0;        // Number of planes that didn't change
+    uint32_t vramPlanes = 0;        // Number of planes with a VRAM safe stream
+    uint32_t lz11Planes = 0;        // Number of planes compressed with LZ11
+    uint32_t dictPlanes = 0;        // Number of planes that use the previous frame as dictionary
+    uint32_t residualPlanes = 0;    // Number of planes XORed with the previous frame
+    uint32_t splitPlanes = 0;       // Number of planes with separate map and character streams
+    uint32_t bilevelPlanes = 0;     // Number of planes with packed two-tone characters
+    uint32_t planes4bpp = 0;        // Number of planes with 4bpp characters
+    uint32_t scrollPlanes = 0;      // Number of planes with a BG scroll offset
+    uint32_t metatilePlanes = 0;    // Number of planes with a metatile map
+    uint32_t referencePlanes = 0;   // Number of planes shown from a reference slot
+    uint64_t ticks = 0;             // Length of the video in VBlanks
+    uint64_t videoBytes = 0;        // Bytes used by plane records
+    uint64_t audioBytes = 0;        // Bytes used by audio blocks
+    uint64_t audioBlocks = 0;       // Number of audio blocks
+    uint64_t silentBlocks = 0;      // Number of audio blocks stored as silence
+    uint64_t monoBlocks = 0;        // Number of audio blocks with a single channel
+    uint64_t lz10Bytes = 0;         // Bytes written by the LZ10 decompressor
+    uint64_t lz11Bytes = 0;         // Bytes written by the LZ11 decompressor
+    uint64_t lz10Time = 0;          // Nanoseconds spent decoding LZ10 planes
+    uint64_t lz11Time = 0;          // Nanoseconds spent decoding LZ11 planes
+};
+
+// Reads a complete .kpv file frame by frame
+class KpvReader {
+public:
+    bool open(const std::string& path);
+
+    // Reads the audio blocks in front of the next frame and decodes all of its planes
+    bool readFrame();
+
+    // Renders a plane of the current frame
+    bool render(int plane, uint8_t* img) {
+        return decoder.render(plane, img);
+    }
+
+    uint32_t getNumFrames() const {
+        return numFrames;
+    }
+
+    uint32_t getVideoFlags() const {
+        return videoFlags;
+    }
+
+    int getNumPlanes() const {
+        return (videoFlags & VIDEO_FLAG_DUAL_SCREEN) ? 2 : 1;
+    }
+
+    const KpvStats& getStats() const {
+        return stats;
+    }
+
+    const std::string& getError() const {
+        return error;
+    }
+
+private:
+    bool readAudioBlock();
+
+    std::vector<uint8_t> data;
+    size_t pos = 0;
+    uint32_t numFrames = 0;
+    uint32_t videoFlags = 0;
+    uint32_t framesRead = 0;
+    uint64_t audioBlocks = 0;
+    KpvDecoder decoder{0};
+    KpvStats stats;
+    std::string error;
+};
@@ -0,0 +1,98 @@
+#include <cmath>
+#include <algorithm>
+
+#include "libkpv.h"
+#include "encoder.h"
+
+struct kpv_encoder {
+    kpv_encoder(const EncoderOptions& options, KpvEncoder::Sink sink) : encoder(options, std::move(sink)) {}
+
+    KpvEncoder encoder;
+};
+
+void kpv_default_options(kpv_options* options) {
+    *options = {};
+    options->audio_rate = audioRate(sampleSize);
+}
+
+kpv_encoder* kpv_encoder_create(const kpv_options* options, kpv_sink sink, void* user) {
+    if (options->reference_slots < 0 || options->reference_slots > maxReferenceSlots || options->reference_tolerance < 0 ||
+        options->audio_rate < audioRate(1) || options->audio_rate > audioRate(sampleSize) || options->tile_order < TILE_ORDER_RASTER ||
+        options->tile_order > TILE_ORDER_STABLE) {
+        return nullptr;
+    }
+
+    // Same rules as BadAppleEncode's options
+    if (options->vram && (options->dict || options->residual || options->split || options->bilevel || options->use_4bpp ||
+                          options->scroll || options->grid_phase || options->metatiles || options->reference_slots)) {
+        return nullptr;
+    }
+
+    EncoderOptions encoderOptions;
+    encoderOptions.videoFlags = VIDEO_FLAG_AUDIO_BLOCK_TYPES | (options->reference_slots << VIDEO_REFERENCE_SLOTS_SHIFT);
+    if (options->dual_screen) {
+        encoderOptions.videoFlags |= VIDEO_FLAG_DUAL_SCREEN;
+    }
+    if (options->solid_tiles) {
+        encoderOptions.videoFlags |= VIDEO_FLAG_SOLID_TILES;
+    }
+    if (options->mono) {
+        encoderOptions.videoFlags |= VIDEO_FLAG_MONO;
+    }
+    int blockSamples = static_cast<int>(std::lround(static_cast<double>(options->audio_rate) * ticksPerAudioBlock / displayRate));
+    if (blockSamples != sampleSize) {
+        encoderOptions.videoFlags |= blockSamples << VIDEO_AUDIO_BLOCK_SHIFT;
+    }
+    encoderOptions.vramSafe = options->vram != 0;
+    encoderOptions.lz11 = options->lz11 != 0;
+    encoderOptions.dictionary = options->dict != 0;
+    encoderOptions.residual = options->residual != 0;
+    encoderOptions.split = options->split != 0;
+    encoderOptions.bilevel = options->bilevel != 0;
+    encoderOptions.use4bpp = options->use_4bpp != 0;
+    encoderOptions.scroll = options->scroll != 0;
+    encoderOptions.gridPhase = options->grid_phase != 0;
+    encoderOptions.metatiles = options->metatiles != 0;
+    encoderOptions.tileOrder = options->tile_order;
+    encoderOptions.referenceTolerance = options->reference_tolerance;
+
+    auto* encoder = new kpv_encoder(encoderOptions, [sink, user](const uint8_t* data, size_t size, uint64_t offset) {
+        return sink(user, data, size, offset) != 0;
+    });
+    encoder->encoder.setVerify(options->verify);
+    return encoder;
+}
+
+int kpv_encoder_push_frame(kpv_encoder* encoder, const uint8_t* pixels, int width, int height, size_t stride, int channels,
+                           uint64_t duration) {
+    return encoder->encoder.pushFrame(pixels, width, height, stride, channels, duration);
+}
+
+int kpv_encoder_push_audio(kpv_encoder* encoder, const int16_t* samples, size_t num_samples) {
+    return encoder->encoder.pushAudio(samples, num_samples);
+}
+
+uint64_t kpv_encoder_missing_audio(const kpv_encoder* encoder) {
+    return encoder->encoder.getMissingAudio();
+}
+
+int kpv_encoder_finish(kpv_encoder* encoder) {
+    return encoder->encoder.finish();
+}
+
+size_t kpv_encoder_queue_stats(const kpv_encoder* encoder, kpv_queue_stats* stats, size_t max_queues) {
+    std::vector<QueueStats> queues = encoder->encoder.getQueueStats();
+    for (size_t i = 0; i < std::min(max_queues, queues.size()); i++) {
+        const QueueStats& queue = queues[i];
+        stats[i] = {queue.name, queue.capacity, queue.items, queue.averageOccupancy, queue.maxOccupancy, queue.fullSeconds, queue.emptySeconds};
+    }
+    return queues.size();
+}
+
+const char* kpv_encoder_error(const kpv_encoder* encoder) {
+    return encoder->encoder.getError().c_str();
+}
+
+void kpv_encoder_destroy(kpv_encoder* encoder) {
+    delete encoder;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// C interface of the .kpv encoder, so it can be embedded into other programs. Every encoder keeps its own state, so
+// several of them can encode at the same time, but a single encoder must only be called from one thread at a time
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct kpv_encoder kpv_encoder;
+
+// Gets called with every piece of the file and the offset it belongs at, from a thread of the encoder. Everything gets
+// appended, except for the number of frames, which kpv_encoder_finish writes into the header at offset 0. Returns 0 if
+// it couldn't be written
+typedef int (*kpv_sink)(void* user, const uint8_t* data, size_t size, uint64_t offset);
+
+// Settings of a video. The flags are 0 or 1, just like the options of BadAppleEncode with the same name
+typedef struct kpv_options {
+    int dual_screen;        // Images are 256x384 and get shown on both screens
+    int solid_tiles;
+    int mono;               // The audio is mono, so the DS only needs one buffer
+    int reference_slots;    // 0-8
+    int reference_tolerance;    // Total brightness difference to a reference slot that still counts as a match, 0 is exact
+    int audio_rate;         // Sample rate of the pushed audio, which gets rounded to a multiple of 15 Hz (up to 48000)
+    int vram;
+    int lz11;
+    int dict;
+    int residual;
+    int split;
+    int bilevel;
+    int use_4bpp;
+    int scroll;
+    int grid_phase;
+    int metatiles;
+    int tile_order;         // 0 raster, 1 chain, 2 stable
+    int verify;             // Decode every frame again and check that it matches the image
+} kpv_options;
+
+// Fills in the defaults: a single screen, 48000 Hz stereo audio and nothing else
+void kpv_default_options(kpv_options* options);
+
+// Starts a new video. Returns NULL if the options can't be combined
+kpv_encoder* kpv_encoder_create(const kpv_options* options, kpv_sink sink, void* user);
+
+// Converts an RGB (3 channels) or grayscale (1 channel) image with rows stride bytes apart, which stays on screen for
+// duration VBlanks, and hands it to the threads that compress it. Images that don't have the size of the screens get
+// scaled. The pixels are only read during the call. Waits while the threads are busy. Returns 0 on error
+int kpv_encoder_push_frame(kpv_encoder* encoder, const uint8_t* pixels, int width, int height, size_t stride, int channels,
+                           uint64_t duration);
+
+// Adds num_samples interleaved 16 bit stereo samples at the audio rate. Frames only get written once the audio in front
+// of them is there, so the audio should be pushed along with the images. Returns 0 on error
+int kpv_encoder_push_audio(kpv_encoder* encoder, const int16_t* samples, size_t num_samples);
+
+// Number of stereo samples that still have to be pushed before every frame can be written
+uint64_t kpv_encoder_missing_audio(const kpv_encoder* encoder);
+
+// Writes everything that's left, with silence for missing audio. Returns 0 on error
+int kpv_encoder_finish(kpv_encoder* encoder);
+
+// How full a queue between two stages of the encoder was. A queue that's full most of the time is waiting for the stage
+// behind it, and one that's empty most of the time is waiting for the stage in front of it
+typedef struct kpv_queue_stats {
+    const char* name;
+    size_t capacity;
+    uint64_t items;             // Items that went through
+    double average_occupancy;   // Items in the queue right after a push, on average
+    size_t max_occupancy;
+    double full_seconds;        // Time the producer spent waiting for a free slot
+    double empty_seconds;       // Time the consumer spent waiting for an item
+} kpv_queue_stats;
+
+// Fills in up to max_queues queues in the order of the stages. Returns the number of queues the encoder has
+size_t kpv_encoder_queue_stats(const kpv_encoder* encoder, kpv_queue_stats* stats, size_t max_queues);
+
+// Tells what went wrong after a call returned 0
+const char* kpv_encoder_error(const kpv_encoder* encoder);
+
+void kpv_encoder_destroy(kpv_encoder* encoder);
+
+#ifdef __cplusplus
+}
+#endif
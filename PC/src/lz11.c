@@ -0,0 +1,150 @@
+/*----------------------------------------------------------------------------*/
+/*--  lz11.c - LZ11 (extended length LZ77) coding for Nintendo DS          --*/
+/*--                                                                        --*/
+/*--  Same window as LZSS (type 0x10), but a match can be up to 65808 bytes --*/
+/*--  long, so long runs of the same tiles only cost a few bytes.           --*/
+/*----------------------------------------------------------------------------*/
+
+/*----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lz11.h"
+
+/*----------------------------------------------------------------------------*/
+#define CMD_CODE_11   0x11       // LZ11 magic number
+
+#define LZ11_N        0x1000     // max offset (1 << 12)
+#define LZ11_MIN      3          // shortest match
+#define LZ11_F1       0x10       // longest match with a 2 byte token
+#define LZ11_F2       0x110      // longest match with a 3 byte token
+#define LZ11_F3       0x10110    // longest match with a 4 byte token
+
+#define LZ11_HASH     0x1000     // number of hash chains
+#define LZ11_CHAIN    256        // max positions checked per match
+
+/*----------------------------------------------------------------------------*/
+#define EXIT(text)  { printf(text); exit(-1); }
+
+/*----------------------------------------------------------------------------*/
+static unsigned int LZ11_Hash(unsigned char *p) {
+	return ((p[0] << 8) ^ (p[1] << 4) ^ p[2]) & (LZ11_HASH - 1);
+}
+
+/*----------------------------------------------------------------------------*/
+char *LZ11_Encode(unsigned char *raw_buffer, int raw_len, int *new_len, int vram,
+                  unsigned char *dict_buffer, int dict_len) {
+	unsigned char *pak_buffer, *pak, *flg, *buffer;
+	int           *head, *prev;
+	int            pos, len, best_len, best_pos, cand, chain, max_len, min_dist, i, end;
+	unsigned char  mask;
+
+	if (dict_len > LZ11_N) {
+		dict_buffer += dict_len - LZ11_N;
+		dict_len = LZ11_N;
+	}
+
+	// the dictionary sits right in front of the data, like the decoder sees it
+	end = dict_len + raw_len;
+	buffer = (unsigned char *) malloc(end + 1);
+	pak_buffer = (unsigned char *) calloc(4 + raw_len + (raw_len + 7) / 8, 1);
+	head = (int *) malloc(LZ11_HASH * sizeof(int));
+	prev = (int *) malloc((end + 1) * sizeof(int));
+	if ((buffer == NULL) || (pak_buffer == NULL) || (head == NULL) || (prev == NULL)) EXIT("\nMemory error\n");
+
+	if (dict_len) memcpy(buffer, dict_buffer, dict_len);
+	memcpy(buffer + dict_len, raw_buffer, raw_len);
+
+	for (i = 0; i < LZ11_HASH; i++) head[i] = -1;
+
+	for (pos = 0; pos < dict_len; pos++) {
+		if (pos + LZ11_MIN <= end) {
+			unsigned int hash = LZ11_Hash(buffer + pos);
+			prev[pos] = head[hash];
+			head[hash] = pos;
+		}
+	}
+
+	*(unsigned int *)pak_buffer = CMD_CODE_11 | (raw_len << 8);
+	pak = pak_buffer + 4;
+	flg = pak;
+
+	// The VRAM functions write 16 bits at once, so the byte right in front isn't there yet
+	min_dist = vram ? 2 : 1;
+
+	mask = 0;
+	pos = dict_len;
+	while (pos < end) {
+		if (!(mask >>= 1)) {
+			*(flg = pak++) = 0;
+			mask = 0x80;
+		}
+
+		// Look for the longest match in the window
+		best_len = 0;
+		best_pos = 0;
+		max_len = end - pos < LZ11_F3 ? end - pos : LZ11_F3;
+
+		if (max_len >= LZ11_MIN) {
+			cand = head[LZ11_Hash(buffer + pos)];
+			for (chain = 0; (cand >= 0) && (pos - cand <= LZ11_N) && (chain < LZ11_CHAIN); chain++) {
+				if ((pos - cand >= min_dist) && (buffer[cand + best_len] == buffer[pos + best_len])) {
+					for (len = 0; len < max_len; len++)
+						if (buffer[cand + len] != buffer[pos + len]) break;
+
+					if (len > best_len) {
+						best_len = len;
+						best_pos = cand;
+						if (len == max_len) break;
+					}
+				}
+				cand = prev[cand];
+			}
+		}
+
+		if (best_len >= LZ11_MIN) {
+			int dist = pos - best_pos - 1;
+
+			*flg |= mask;
+			if (best_len <= LZ11_F1) {
+				*pak++ = ((best_len - 1) << 4) | (dist >> 8);
+				*pak++ = dist & 0xFF;
+			} else if (best_len <= LZ11_F2) {
+				len = best_len - (LZ11_F1 + 1);
+				*pak++ = len >> 4;
+				*pak++ = ((len & 0xF) << 4) | (dist >> 8);
+				*pak++ = dist & 0xFF;
+			} else {
+				len = best_len - (LZ11_F2 + 1);
+				*pak++ = 0x10 | (len >> 12);
+				*pak++ = (len >> 4) & 0xFF;
+				*pak++ = ((len & 0xF) << 4) | (dist >> 8);
+				*pak++ = dist & 0xFF;
+			}
+		} else {
+			best_len = 1;
+			*pak++ = buffer[pos];
+		}
+
+		// Add every position that got coded to the hash chains
+		for (i = 0; i < best_len; i++, pos++) {
+			if (pos + LZ11_MIN <= end) {
+				unsigned int hash = LZ11_Hash(buffer + pos);
+				prev[pos] = head[hash];
+				head[hash] = pos;
+			}
+		}
+	}
+
+	*new_len = pak - pak_buffer;
+
+	free(buffer);
+	free(head);
+	free(prev);
+
+	return((char *) pak_buffer);
+}
+
+/*----------------------------------------------------------------------------*/
+/*--  EOF                                                                   --*/
+/*----------------------------------------------------------------------------*/
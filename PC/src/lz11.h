@@ -0,0 +1,25 @@
+/*----------------------------------------------------------------------------*/
+/*--  lz11.h - LZ11 (extended length LZ77) coding for Nintendo DS          --*/
+/*----------------------------------------------------------------------------*/
+
+#ifndef LZ11_H
+#define LZ11_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*----------------------------------------------------------------------------*/
+/* Compresses raw_buffer into a type 0x11 stream. Matches can be up to 65808  */
+/* bytes long. If vram is set, matches with a distance of 1 byte are never    */
+/* used. If dict_len isn't 0, matches can also reach back into the 4096 bytes */
+/* of dict_buffer, as if they had been decoded right in front of the data.    */
+/* The returned buffer has to be freed by the caller                          */
+char *LZ11_Encode(unsigned char *raw_buffer, int raw_len, int *new_len, int vram,
+                  unsigned char *dict_buffer, int dict_len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -33,19 +33,21 @@
 #define LZS_N         0x1000     // max offset (1 << 12)
 #define LZS_F         0x12       // max coded ((1 << 4) + LZS_THRESHOLD)
 #define LZS_NIL       LZS_N      // index for root of binary search trees
+#define LZS_DICT      (LZS_N - LZS_F) // max size of a preset dictionary
 
 /*----------------------------------------------------------------------------*/
 char *Memory(int length, int size);
 
-char *LZS_Fast(unsigned char *raw_buffer, int raw_len, int *new_len);
-void  LZS_InitTree(void);
-void  LZS_InsertNode(int r);
-void  LZS_DeleteNode(int p);
+void  LZS_InitTree(LZS_Context *ctx);
+void  LZS_InsertNode(LZS_Context *ctx, int r);
+void  LZS_DeleteNode(LZS_Context *ctx, int p);
 
 /*----------------------------------------------------------------------------*/
-unsigned char ring[LZS_N + LZS_F - 1];
-int           dad[LZS_N + 1], lson[LZS_N + 1], rson[LZS_N + 1 + 256];
-int           pos_ring, len_ring, lzs_vram;
+struct LZS_Context {
+	unsigned char ring[LZS_N + LZS_F - 1];
+	int           dad[LZS_N + 1], lson[LZS_N + 1], rson[LZS_N + 1 + 256];
+	int           pos_ring, len_ring, vram;
+};
 
 /*----------------------------------------------------------------------------*/
 #define EXIT(text)  { printf(text); exit(-1); }
@@ -61,9 +63,27 @@ char *Memory(int length, int size) {
 }
 
 /*----------------------------------------------------------------------------*/
-char *LZS_Fast(unsigned char *raw_buffer, int raw_len, int *new_len) {
+LZS_Context *LZS_CreateContext(void) {
+	return((LZS_Context *) Memory(1, sizeof(LZS_Context)));
+}
+
+/*----------------------------------------------------------------------------*/
+void LZS_FreeContext(LZS_Context *ctx) {
+	free(ctx);
+}
+
+/*----------------------------------------------------------------------------*/
+char *LZS_Fast(LZS_Context *ctx, unsigned char *raw_buffer, int raw_len, int *new_len,
+               int vram) {
+	return(LZS_FastDict(ctx, raw_buffer, raw_len, new_len, vram, NULL, 0));
+}
+
+/*----------------------------------------------------------------------------*/
+char *LZS_FastDict(LZS_Context *ctx, unsigned char *raw_buffer, int raw_len, int *new_len,
+                   int vram, unsigned char *dict_buffer, int dict_len) {
+	unsigned char *ring = ctx->ring;
 	unsigned char *pak_buffer, *pak, *raw, *raw_end, *flg;
-	unsigned int   pak_len, len, r, s, len_tmp, i;
+	unsigned int   pak_len, len, r, s, len_tmp, i, d;
 	unsigned char  mask; 
 
 	pak_len = 4 + raw_len + ((raw_len + 7) / 8); // compressed len
@@ -75,7 +95,8 @@ char *LZS_Fast(unsigned char *raw_buffer, int raw_len, int *new_len) {
 	raw = raw_buffer; // pointer to raw data
 	raw_end = raw_buffer + raw_len; // pointer to end of raw data
 
-	LZS_InitTree();
+	ctx->vram = vram;
+	LZS_InitTree(ctx);
 
 	r = s = 0;
 
@@ -84,7 +105,16 @@ char *LZS_Fast(unsigned char *raw_buffer, int raw_len, int *new_len) {
 
 	for (i = 0; i < len; i++) ring[r + i] = *raw++;
 
-		LZS_InsertNode(r);
+	// the dictionary sits right in front of the data, like the decoder sees it
+	if (dict_len > LZS_DICT) {
+		dict_buffer += dict_len - LZS_DICT;
+		dict_len = LZS_DICT;
+	}
+	d = r - dict_len;
+	for (i = 0; i < (unsigned int)dict_len; i++) ring[d + i] = dict_buffer[i];
+	for (i = 0; i < (unsigned int)dict_len; i++) LZS_InsertNode(ctx, d + i);
+
+		LZS_InsertNode(ctx, r);
 
 	mask = 0;
 
@@ -94,33 +124,33 @@ char *LZS_Fast(unsigned char *raw_buffer, int raw_len, int *new_len) {
 			mask = LZS_MASK;
 		}
 
-		if (len_ring > len) len_ring = len;
+		if (ctx->len_ring > len) ctx->len_ring = len;
 
-		if (len_ring > LZS_THRESHOLD) {
+		if (ctx->len_ring > LZS_THRESHOLD) {
 			*flg |= mask;
-			pos_ring = ((r - pos_ring) & (LZS_N - 1)) - 1;
-			*pak++ = ((len_ring - LZS_THRESHOLD - 1) << 4) | (pos_ring >> 8);
-			*pak++ = pos_ring & 0xFF;
+			ctx->pos_ring = ((r - ctx->pos_ring) & (LZS_N - 1)) - 1;
+			*pak++ = ((ctx->len_ring - LZS_THRESHOLD - 1) << 4) | (ctx->pos_ring >> 8);
+			*pak++ = ctx->pos_ring & 0xFF;
 		} else {
-			len_ring = 1;
+			ctx->len_ring = 1;
 			*pak++ = ring[r];
 		}
 
-		len_tmp = len_ring;
+		len_tmp = ctx->len_ring;
 		for (i = 0; i < len_tmp; i++) {
 			if (raw == raw_end) break;
-			LZS_DeleteNode(s);
+			LZS_DeleteNode(ctx, s);
 			ring[s] = *raw++;
 			if (s < LZS_F - 1) ring[s + LZS_N] = ring[s];
 			s = (s + 1) & (LZS_N - 1);
 			r = (r + 1) & (LZS_N - 1);
-			LZS_InsertNode(r);
+			LZS_InsertNode(ctx, r);
 		}
 		while (i++ < len_tmp) {
-			LZS_DeleteNode(s);
+			LZS_DeleteNode(ctx, s);
 			s = (s + 1) & (LZS_N - 1);
 			r = (r + 1) & (LZS_N - 1);
-			if (--len) LZS_InsertNode(r);
+			if (--len) LZS_InsertNode(ctx, r);
 		}
 	}
 
@@ -130,7 +160,8 @@ char *LZS_Fast(unsigned char *raw_buffer, int raw_len, int *new_len) {
 }
 
 /*----------------------------------------------------------------------------*/
-void LZS_InitTree(void) {
+void LZS_InitTree(LZS_Context *ctx) {
+	int *dad = ctx->dad, *rson = ctx->rson;
 	int i;
 
 	for (i = LZS_N + 1; i <= LZS_N + 256; i++)
@@ -141,14 +172,16 @@ void LZS_InitTree(void) {
 }
 
 /*----------------------------------------------------------------------------*/
-void LZS_InsertNode(int r) {
+void LZS_InsertNode(LZS_Context *ctx, int r) {
+	unsigned char *ring = ctx->ring;
+	int           *dad = ctx->dad, *lson = ctx->lson, *rson = ctx->rson;
 	unsigned char *key;
 	int            i, p, cmp, prev;
 
 	prev = (r - 1) & (LZS_N - 1);
 
 	cmp = 1;
-	len_ring = 0;
+	ctx->len_ring = 0;
 
 	key = &ring[r];
 	p = LZS_N + 1 + key[0];
@@ -167,10 +200,10 @@ void LZS_InsertNode(int r) {
 		for (i = 1; i < LZS_F; i++)
 			if ((cmp = key[i] - ring[p + i])) break;
 
-		if (i > len_ring) {
-			if (!lzs_vram || (p != prev)) {
-				pos_ring = p;
-				if ((len_ring = i) == LZS_F) break;
+		if (i > ctx->len_ring) {
+			if (!ctx->vram || (p != prev)) {
+				ctx->pos_ring = p;
+				if ((ctx->len_ring = i) == LZS_F) break;
 			}
 		}
 	}
@@ -186,7 +219,8 @@ void LZS_InsertNode(int r) {
 }
 
 /*----------------------------------------------------------------------------*/
-void LZS_DeleteNode(int p) {
+void LZS_DeleteNode(LZS_Context *ctx, int p) {
+	int *dad = ctx->dad, *lson = ctx->lson, *rson = ctx->rson;
 	int q;
 
 	if (dad[p] == LZS_NIL) return;
@@ -0,0 +1,39 @@
+/*----------------------------------------------------------------------------*/
+/*--  lzss.h - LZSS coding for Nintendo GBA/DS                              --*/
+/*--  Copyright (C) 2011 CUE                                                --*/
+/*--  Modified by KonPet                                                    --*/
+/*----------------------------------------------------------------------------*/
+
+#ifndef LZSS_H
+#define LZSS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*----------------------------------------------------------------------------*/
+/* The window and the binary search trees of the encoder. Every thread that   */
+/* compresses at the same time needs a context of its own                     */
+typedef struct LZS_Context LZS_Context;
+
+LZS_Context *LZS_CreateContext(void);
+void         LZS_FreeContext(LZS_Context *ctx);
+
+/*----------------------------------------------------------------------------*/
+/* If vram is set, matches with a distance of 1 byte are never used, so the   */
+/* stream can be decompressed with the BIOS' 16 bit VRAM function             */
+char *LZS_Fast(LZS_Context *ctx, unsigned char *raw_buffer, int raw_len, int *new_len,
+               int vram);
+
+/*----------------------------------------------------------------------------*/
+/* Same as LZS_Fast, but the window starts out with dict_buffer instead of    */
+/* zeros, as if it had been decoded right in front of the data. Only the      */
+/* first 4078 bytes of the dictionary can be used                             */
+char *LZS_FastDict(LZS_Context *ctx, unsigned char *raw_buffer, int raw_len, int *new_len,
+                   int vram, unsigned char *dict_buffer, int dict_len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
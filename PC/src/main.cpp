@@ -2,265 +2,833 @@
 #include <filesystem>
 #include <vector>
 #include <fstream>
+#include <algorithm>
+#include <memory>
+#include <cmath>
+#include <cstring>
+
+#include "encoder.h"
+#include "resample.h"
+#include "framesource.h"
+#include "ffmpeg.h"
+#include "pipeline.h"
+
+// Decoded audio gets handed on in chunks of this many audio blocks
+constexpr int audioChunkBlocks = 16;
+
+// Checkpointing
+constexpr unsigned int checkpointInterval = 1000;   // How many frames get encoded between two checkpoints
+constexpr uint32_t checkpointMagic = 0x4356504B;    // "KPVC"
+constexpr uint32_t checkpointVersion = 2;           // Has to be increased whenever the fields of a checkpoint change
+constexpr size_t checkpointHeaderSize = 16;         // Magic, version and the 64 bit size of the fields
+const char* outputPath = "BadApple.kpv";
+const char* checkpointPath = "BadApple.kpv.ckpt";
+
+// Everything needed to continue an encode exactly where it stopped
+struct Checkpoint {
+    EncoderOptions options;     // The options the encode was started with
+    EncoderState state;         // Knows how much of the output file it refers to
+};
 
-#define STB_IMAGE_IMPLEMENTATION
-#include "stb_image.h"
-#include "lzss.h"
+// Appends the fields of a checkpoint in little endian, so the file doesn't depend on the compiler
+struct CheckpointWriter {
+    std::vector<uint8_t> data;
 
-// Frame flags
-#define FLAG_COMPRESSION_STAY            1
-#define FLAG_COMPRESSION_CHARACTERS     (1 << 1)
-#define FLAG_COMPRESSION_LZ77           (1 << 2)
+    template<typename T>
+    void operator()(T& value) {
+        for (size_t i = 0; i < sizeof(T); i++) {
+            data.push_back(static_cast<uint8_t>(static_cast<uint64_t>(value) >> (i * 8)));
+        }
+    }
 
-// DS Screen data
-constexpr int imgWidth = 256;
-constexpr int imgHeight = 192;
-constexpr int tileWidth = 8;
-constexpr int tileHeight = 8;
+    void operator()(uint8_t* bytes, size_t size) {
+        data.insert(data.end(), bytes, bytes + size);
+    }
+};
 
-constexpr int sampleSize = 3200;
+// Reads the fields back in the same order. ok turns false if there aren't enough bytes left
+struct CheckpointReader {
+    const uint8_t* pos;
+    const uint8_t* end;
+    bool ok = true;
+
+    template<typename T>
+    void operator()(T& value) {
+        if (static_cast<size_t>(end - pos) < sizeof(T)) {
+            ok = false;
+            return;
+        }
+        uint64_t bits = 0;
+        for (size_t i = 0; i < sizeof(T); i++) {
+            bits |= static_cast<uint64_t>(*pos++) << (i * 8);
+        }
+        value = static_cast<T>(bits);
+    }
 
-// CUE's LZSS compressor
-extern "C" char *LZS_Fast(unsigned char *raw_buffer, int raw_len, int *new_len);
+    void operator()(uint8_t* bytes, size_t size) {
+        if (static_cast<size_t>(end - pos) < size) {
+            ok = false;
+            return;
+        }
+        memcpy(bytes, pos, size);
+        pos += size;
+    }
+};
+
+// Hands every field of a checkpoint to field one by one. New fields of EncoderOptions or EncoderState have to be added
+// here, along with a new checkpointVersion
+template<typename Field>
+void checkpointFields(Checkpoint& checkpoint, Field& field) {
+    EncoderOptions& options = checkpoint.options;
+    field(options.videoFlags);
+    field(options.fpsNum);
+    field(options.fpsDen);
+    field(options.vramSafe);
+    field(options.lz11);
+    field(options.dictionary);
+    field(options.residual);
+    field(options.split);
+    field(options.bilevel);
+    field(options.use4bpp);
+    field(options.scroll);
+    field(options.gridPhase);
+    field(options.metatiles);
+    field(options.tileOrder);
+    field(options.referenceTolerance);
+
+    EncoderState& state = checkpoint.state;
+    field(state.frameNum);
+    field(state.sourceFrame);
+    field(state.displayTick);
+    field(state.audioBlocks);
+    field(state.audioOff);
+    field(state.outputBytes);
+    field(state.lz10Bytes);
+    field(state.imgDataBytes);
+    field(state.lz11Frames);
+    field(state.dictFrames);
+    field(state.residualFrames);
+    field(state.splitFrames);
+    field(state.bilevelFrames);
+    field(state.frames4bpp);
+    field(state.scrollFrames);
+    field(state.metatileFrames);
+    field(state.referenceFrames);
+    for (int plane = 0; plane < maxPlanes; plane++) {
+        field(state.scroll[plane], sizeof(state.scroll[plane]));
+        field(state.bufferImg[plane], sizeof(state.bufferImg[plane]));
+        field(state.lastBuffer[plane], sizeof(state.lastBuffer[plane]));
+        for (ReferenceSlot& ref : state.references[plane]) {
+            field(ref.used);
+            field(ref.extFlags);
+            field(ref.scroll, sizeof(ref.scroll));
+            field(ref.lastUse);
+            field(ref.hash);
+            field(ref.img, sizeof(ref.img));
+            field(ref.buffer, sizeof(ref.buffer));
+        }
+    }
+}
 
-// Storing characters in classes makes it a bit easier to work with them later on
-class Character {
-public:
-    Character() : pixels{} {}
+// Writes the checkpoint to a temporary file first and renames it afterwards, so a crash never leaves a broken one behind
+bool saveCheckpoint(Checkpoint& checkpoint) {
+    std::string tmpPath = std::string(checkpointPath) + ".tmp";
+    std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
 
-    uint8_t* getPixels() {
-        return pixels;
+    if (!file) {
+        return false;
     }
 
-private:
-    uint8_t pixels[tileWidth * tileHeight];
-};
+    CheckpointWriter fields;
+    checkpointFields(checkpoint, fields);
 
-bool operator==(Character& c1, Character& c2) {
-    for (int i = 0; i < tileWidth * tileHeight; i++) {
-        if (c1.getPixels()[i] != c2.getPixels()[i]) {
-            return false;
-        }
+    CheckpointWriter writer;
+    uint32_t magic = checkpointMagic;
+    uint32_t version = checkpointVersion;
+    uint64_t size = fields.data.size();
+    writer(magic);
+    writer(version);
+    writer(size);
+    writer(fields.data.data(), fields.data.size());
+
+    file.write(reinterpret_cast<const char*>(writer.data.data()), static_cast<std::streamsize>(writer.data.size()));
+    file.close();
+
+    if (!file) {
+        return false;
     }
-    return true;
+
+    std::error_code error;
+    std::filesystem::rename(tmpPath, checkpointPath, error);
+    return !error;
 }
 
-// Get the perceived brightness
-uint8_t getBrightness(const uint8_t* pixel) {
-    return static_cast<uint8_t>((0.2126 * pixel[0]) + (0.7152 * pixel[1]) + (0.0722 * pixel[2]));
+// Loads the last checkpoint. Returns false if there is none, it was made by another version of the encoder or it doesn't
+// match the output file
+bool loadCheckpoint(Checkpoint& checkpoint) {
+    std::ifstream file(checkpointPath, std::ios::binary);
+
+    if (!file) {
+        return false;
+    }
+
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    CheckpointReader reader{data.data(), data.data() + data.size()};
+    uint32_t magic = 0;
+    uint32_t version = 0;
+    uint64_t size = 0;
+    reader(magic);
+    reader(version);
+    reader(size);
+
+    if (!reader.ok || magic != checkpointMagic) {
+        return false;
+    }
+
+    // The fields always take up the same number of bytes, so a different size means the layout changed
+    CheckpointWriter expected;
+    checkpointFields(checkpoint, expected);
+    if (version != checkpointVersion || size != expected.data.size() || data.size() != checkpointHeaderSize + size) {
+        std::cout << "Ignoring the checkpoint, since it was made by another version of the encoder" << std::endl;
+        return false;
+    }
+
+    checkpointFields(checkpoint, reader);
+    if (!reader.ok) {
+        return false;
+    }
+
+    // The output file must contain at least everything the checkpoint refers to
+    std::error_code error;
+    auto outputSize = std::filesystem::file_size(outputPath, error);
+    return !error && outputSize >= checkpoint.state.outputBytes;
 }
 
-// Checks if a given tile is in the tile map
-bool checkForTile(std::vector<Character>& tileMap, Character& tile, uint16_t* location = nullptr) {
-    for (size_t i = 0; i < tileMap.size(); i++) {
-        if (tileMap[i] == tile) {
-            if (location != nullptr) {
-                *location = i;
+// Takes a WAV file (16 bit PCM) or raw 16 bit stereo audio at rawRate and resamples it to outRate. Mono audio gets copied
+// to both channels, so samples always holds interleaved stereo samples. Returns false if the audio can't be used
+bool parseAudio(const std::vector<uint8_t>& data, int rawRate, int outRate, std::vector<int16_t>& samples) {
+    int numChannels = 2;
+    int inRate = rawRate;
+    size_t dataStart = 0;
+    size_t dataSize = data.size();
+
+    // A WAV file consists of chunks, and only fmt and data matter
+    if (data.size() >= 12 && !memcmp(&data[0], "RIFF", 4) && !memcmp(&data[8], "WAVE", 4)) {
+        bool hasFormat = false;
+        dataSize = 0;
+        for (size_t pos = 12; pos + 8 <= data.size();) {
+            uint32_t chunkSize = data[pos + 4] | (data[pos + 5] << 8) | (data[pos + 6] << 16) | (data[pos + 7] << 24);
+            size_t chunkEnd = std::min<size_t>(pos + 8 + static_cast<size_t>(chunkSize), data.size());
+
+            if (!memcmp(&data[pos], "fmt ", 4) && chunkSize >= 16 && pos + 24 <= data.size()) {
+                // Format 1 is PCM and 0xFFFE (WAVE_FORMAT_EXTENSIBLE) is fine as long as it has 16 bit samples
+                int format = data[pos + 8] | (data[pos + 9] << 8);
+                numChannels = data[pos + 10] | (data[pos + 11] << 8);
+                inRate = static_cast<int>(data[pos + 12] | (data[pos + 13] << 8) | (data[pos + 14] << 16) | (data[pos + 15] << 24));
+                int bitsPerSample = data[pos + 22] | (data[pos + 23] << 8);
+                if ((format != 1 && format != 0xFFFE) || bitsPerSample != 16 || numChannels < 1 || numChannels > 2 || inRate <= 0) {
+                    return false;
+                }
+                hasFormat = true;
+            } else if (!memcmp(&data[pos], "data", 4)) {
+                dataStart = pos + 8;
+                dataSize = chunkEnd - dataStart;
             }
-            return true;
+
+            // Chunks are padded to an even size
+            pos += 8 + static_cast<size_t>(chunkSize) + (chunkSize & 1);
+        }
+        if (!hasFormat) {
+            return false;
         }
     }
-    return false;
-}
 
-// Loads tile map from image
-void loadTileMap(std::vector<Character>& tileMap, uint16_t* map, uint8_t* img) {
-    tileMap.clear();
-    Character tileBuffer;
-    uint16_t index;
-
-    // Iterates over all tiles in the image
-    for (int y = 0; y < imgHeight; y += tileHeight) {
-        for (int x = 0; x < imgWidth; x += tileWidth) {
-            // Copies a tile into the tileBuffer
-            for (int h = 0; h < tileHeight; h++) {
-                memcpy(&tileBuffer.getPixels()[h * tileWidth], &img[(y + h) * 256 + x], tileWidth);
-            }
+    std::vector<int16_t> input(dataSize / (2 * numChannels) * numChannels);
+    if (!input.empty()) {
+        memcpy(input.data(), &data[dataStart], input.size() * 2);
+    }
 
-            // Checks if the tile is already in the tile map
-            if (!checkForTile(tileMap, tileBuffer, &index)) {
-                map[(y / tileHeight) * imgWidth / tileWidth + x / tileWidth] = tileMap.size() + 0x18;
-                tileMap.push_back(tileBuffer);
-            } else {
-                map[(y / tileHeight) * imgWidth / tileWidth + x / tileWidth] = index + 0x18;
-            }
+    std::vector<int16_t> output = resample(input, numChannels, inRate, outRate);
+    if (numChannels == 2) {
+        samples = std::move(output);
+    } else {
+        samples.resize(output.size() * 2);
+        for (size_t i = 0; i < output.size(); i++) {
+            samples[i * 2] = output[i];
+            samples[i * 2 + 1] = output[i];
         }
     }
+    return true;
 }
 
-void compressFrame(uint8_t* dataIn, uint8_t*& imgData, uint8_t* bufferImg, uint8_t& flags, size_t& imgDataSize) {
-    // Used for calculating sizes later
-    int mapSize = (imgWidth / tileWidth) * (imgHeight / tileHeight);
-    int charBaseSize = (imgWidth / tileWidth) * (imgHeight / tileHeight) * (tileWidth * tileHeight);
+bool loadAudio(const std::string& path, int rawRate, int outRate, std::vector<int16_t>& samples) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    return parseAudio(data, rawRate, outRate, samples);
+}
 
-    std::vector<Character> tileMap;
+// An image on its way through the read and decode stages
+struct SourceFrame {
+    uint64_t duration = 0;      // VBlanks it stays on screen. Images with 0 don't get loaded
+    SourceImage image;
+};
 
-    auto *map = new uint16_t[charBaseSize / 2 + mapSize];   // Stores map and tiles
-    auto *img = new uint8_t[imgWidth * imgHeight];          // Stores the grayscale image
+// Interleaved stereo samples, either a whole audio file or the chunks of an audio decoder as they come in
+struct AudioFeed {
+    std::vector<int16_t> samples;                       // The whole file, or the current chunk
+    size_t pos = 0;                                     // Next stereo sample in samples
+    uint64_t skip = 0;                                  // Stereo samples that got encoded before the checkpoint
+    SpscQueue<std::vector<int16_t>>* chunks = nullptr;  // Where the next chunk comes from, if the audio is decoded
+};
 
-    bool changed = false;
+// Pushes as much of the audio as the encoder is waiting for. After the end of the track, the encoder gets silence
+bool pushMissingAudio(KpvEncoder& encoder, AudioFeed& feed) {
+    static const int16_t silence[sampleSize * 2] = {};
 
-    // Converts the image that got loaded by stb_image to an image based on our grayscale perception
-    // It also checks if the last frame was different
-    for (int y = 0; y < imgHeight; y++) {
-        for (int x = 0; x < imgWidth; x++) {
-            img[y * imgWidth + x] = getBrightness(&dataIn[3 * (y * imgWidth + x)]);
-            if (img[y * imgWidth + x] != bufferImg[y * imgWidth + x]) {
-                changed = true;
-            }
+    while (uint64_t missing = feed.skip ? feed.skip : encoder.getMissingAudio()) {
+        size_t available = feed.samples.size() / 2 - feed.pos;
+        if (available == 0 && feed.chunks && feed.chunks->pop(feed.samples)) {
+            feed.pos = 0;
+            continue;
         }
+
+        size_t numSamples = available ? std::min<uint64_t>(missing, available) : std::min<uint64_t>(missing, sampleSize);
+        if (feed.skip) {
+            feed.skip = available ? feed.skip - numSamples : 0;
+        } else if (!encoder.pushAudio(available ? &feed.samples[feed.pos * 2] : silence, numSamples)) {
+            return false;
+        }
+        feed.pos += available ? numSamples : 0;
     }
+    return true;
+}
 
-    // Executes if nothing has changed since the last frame
-    if (!changed) {
-        flags = FLAG_COMPRESSION_STAY;
+// VBlank at which a frame gets shown with a constant frame rate, rounded to the nearest VBlank
+uint64_t constantFrameTick(uint64_t frame, const EncoderOptions& options) {
+    return (frame * displayRate * options.fpsDen + options.fpsNum / 2) / options.fpsNum;
+}
 
-        delete[] map;
-        delete[] img;
-        return;
-    }
+// Calculates the VBlank at which every source frame starts. The last entry is the end of the video
+bool loadFrameTicks(std::vector<uint64_t>& frameTicks, size_t numFrames, const EncoderOptions& options, const std::string& timestampPath) {
+    frameTicks.clear();
 
-    loadTileMap(tileMap, map, img);
-    uint16_t tileMapSize = tileMap.size() * tileWidth * tileHeight;    // Calculate size of tile map in bytes
+    if (timestampPath.empty()) {
+        for (size_t i = 0; i <= numFrames; i++) {
+            frameTicks.push_back(constantFrameTick(i, options));
+        }
+        return true;
+    }
 
-    // Copies the tiles to the map
-    for (size_t i = 0; i < tileMap.size(); i++) {
-        memmove(&map[mapSize + 32 * i], tileMap[i].getPixels(), 64);
+    // One presentation time in seconds per line, like ffprobe's best_effort_timestamp_time
+    std::ifstream timestampFile(timestampPath);
+    if (!timestampFile) {
+        return false;
     }
 
-    // Compress the image using CUE's LZSS function
-    imgData = reinterpret_cast<uint8_t*>(LZS_Fast(reinterpret_cast<uint8_t*>(map), tileMapSize + mapSize * 2,
-                                                  reinterpret_cast<int*> (&imgDataSize)));
+    double timestamp, start = 0;
+    while (frameTicks.size() < numFrames && timestampFile >> timestamp) {
+        if (frameTicks.empty()) {
+            start = timestamp;
+        }
 
-    // Update the image buffer
-    memmove(bufferImg, img, imgWidth * imgHeight);
+        auto tick = static_cast<uint64_t>(std::llround(std::max(0.0, timestamp - start) * displayRate));
+        if (!frameTicks.empty() && tick < frameTicks.back()) {
+            return false;
+        }
+        frameTicks.push_back(tick);
+    }
 
-    flags = FLAG_COMPRESSION_CHARACTERS | FLAG_COMPRESSION_LZ77;
+    if (frameTicks.size() < numFrames) {
+        return false;
+    }
 
-    // Clean up the data
-    delete[] map;
-    delete[] img;
+    // The last frame lasts as long as one frame at the given frame rate
+    frameTicks.push_back(frameTicks.back() + std::max<uint64_t>(1, (displayRate * options.fpsDen + options.fpsNum / 2) / options.fpsNum));
+    return true;
 }
 
-int main()
-{
-    // needed for stb_image
-    int width, height, bpp;
+void printUsage() {
+    std::cout << "Usage: BadAppleEncode [options]\n"
+                 "  --dual                Encode a 256x384 video as two planes, one for each screen\n"
+                 "  --fps <num>[/<den>]   Frame rate of the images in imgs (default 60)\n"
+                 "  --timestamps <file>   Presentation time in seconds of every image, one per line\n"
+                 "  --input <video>       Decode a video with ffmpeg instead of reading imgs and audio.raw. .y4m files get\n"
+                 "                        read directly\n"
+                 "  --raw <file>          Read the images from a file with nothing but images back to back\n"
+                 "  --raw-format <format> Pixels of --raw: gray (default) or rgb24\n"
+                 "  --raw-size <w>x<h>    Size of the images of --raw (default 256x192, or 256x384 with --dual)\n"
+                 "  --ffmpeg <path>       ffmpeg executable used by --input (default ffmpeg)\n"
+                 "  --audio <file>        WAV file (16 bit PCM) or raw 16 bit stereo audio (default audio.raw, or the audio\n"
+                 "                        of the --input video)\n"
+                 "  --audio-rate <hz>     Sample rate of raw audio (default 48000)\n"
+                 "  --mono                Store all of the audio as mono, so the DS only needs one buffer\n"
+                 "  --rate <hz>           Sample rate the audio gets resampled to for the DS, up to 48000 (default 48000)\n"
+                 "  --lz11                Use LZ11 for frames where it's smaller than LZ10\n"
+                 "  --dict                Use the previous frame as a dictionary for frames where that's smaller\n"
+                 "  --residual            XOR frames with the previous frame where that's smaller\n"
+                 "  --split               Compress map and characters as separate streams where that's smaller\n"
+                 "  --bilevel             Pack characters with only two values into 1 bit per pixel where that's smaller\n"
+                 "  --solid-tiles         Point solid tiles at a bank of solid tiles the DS sets up once\n"
+                 "  --4bpp                Store frames with 4bpp characters whenever they fit into the palette banks\n"
+                 "  --scroll              Follow the motion of the image with the BG scroll offset where that's smaller\n"
+                 "  --grid-phase          Shift the tile grid with the BG scroll offset where that's smaller\n"
+                 "  --metatiles           Store the map as a map of 2x2 blocks of map entries where that's smaller\n"
+                 "  --references <n>      Keep the last n (1-8) frames in reference slots and show them again instead of\n"
+                 "                        storing frames that match one of them\n"
+                 "  --ref-tolerance <n>   Also show frames from a reference slot that's off by a total brightness of at\n"
+                 "                        most n (lossy, default 0)\n"
+                 "  --tile-order <order>  Order of the characters: raster (default), chain (similar ones next to each other)\n"
+                 "                        or stable (characters of the previous frame keep their slot)\n"
+                 "  --vram                Make every frame VRAM safe, so the DS can decompress it straight into VRAM\n"
+                 "  --verify              Decode every frame again and check that it matches the image\n"
+                 "  --queue-stats         Show how full the queues between the stages were, to find the slowest stage\n";
+}
 
-    // Used to compress image data
-    uint8_t bufferImg[imgWidth * imgHeight];   // Stores the last image
-    uint8_t* imgData;                          // Stores the compressed image
-    size_t imgDataSize;
-    uint8_t flags;
+int main(int argc, char** argv)
+{
+    EncoderOptions options;
+    std::string timestampPath;
+    std::string audioPath;
+    std::string inputPath;
+    std::string ffmpegPath = "ffmpeg";
+    std::string rawPath;
+    int rawChannels = 1;
+    int rawWidth = 0, rawHeight = 0;
+    int rawAudioRate = 48000;
+    int outputRate = audioRate(sampleSize);
+    bool verify = false;
+    bool queueStats = false;
+    bool forceMono = false;
+
+    // Silent audio blocks only take up a byte
+    options.videoFlags |= VIDEO_FLAG_AUDIO_BLOCK_TYPES;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--dual") {
+            options.videoFlags |= VIDEO_FLAG_DUAL_SCREEN;
+        } else if (arg == "--fps" && i + 1 < argc) {
+            if (sscanf(argv[++i], "%u/%u", &options.fpsNum, &options.fpsDen) < 1 || !options.fpsNum || !options.fpsDen) {
+                printUsage();
+                return 1;
+            }
+        } else if (arg == "--timestamps" && i + 1 < argc) {
+            timestampPath = argv[++i];
+        } else if (arg == "--input" && i + 1 < argc) {
+            inputPath = argv[++i];
+        } else if (arg == "--raw" && i + 1 < argc) {
+            rawPath = argv[++i];
+        } else if (arg == "--raw-format" && i + 1 < argc) {
+            std::string format = argv[++i];
+            if (format == "gray") {
+                rawChannels = 1;
+            } else if (format == "rgb24") {
+                rawChannels = 3;
+            } else {
+                printUsage();
+                return 1;
+            }
+        } else if (arg == "--raw-size" && i + 1 < argc) {
+            if (sscanf(argv[++i], "%dx%d", &rawWidth, &rawHeight) != 2 || rawWidth <= 0 || rawHeight <= 0) {
+                printUsage();
+                return 1;
+            }
+        } else if (arg == "--ffmpeg" && i + 1 < argc) {
+            ffmpegPath = argv[++i];
+        } else if (arg == "--audio" && i + 1 < argc) {
+            audioPath = argv[++i];
+        } else if (arg == "--mono") {
+            forceMono = true;
+        } else if (arg == "--audio-rate" && i + 1 < argc) {
+            rawAudioRate = atoi(argv[++i]);
+            if (rawAudioRate <= 0) {
+                printUsage();
+                return 1;
+            }
+        } else if (arg == "--rate" && i + 1 < argc) {
+            outputRate = atoi(argv[++i]);
+            if (outputRate < audioRate(1) || outputRate > audioRate(sampleSize)) {
+                printUsage();
+                return 1;
+            }
+        } else if (arg == "--lz11") {
+            options.lz11 = 1;
+        } else if (arg == "--dict") {
+            options.dictionary = 1;
+        } else if (arg == "--residual") {
+            options.residual = 1;
+        } else if (arg == "--split") {
+            options.split = 1;
+        } else if (arg == "--bilevel") {
+            options.bilevel = 1;
+        } else if (arg == "--solid-tiles") {
+            options.videoFlags |= VIDEO_FLAG_SOLID_TILES;
+        } else if (arg == "--4bpp") {
+            options.use4bpp = 1;
+        } else if (arg == "--scroll") {
+            options.scroll = 1;
+        } else if (arg == "--grid-phase") {
+            options.gridPhase = 1;
+        } else if (arg == "--metatiles") {
+            options.metatiles = 1;
+        } else if (arg == "--references" && i + 1 < argc) {
+            int numSlots = atoi(argv[++i]);
+            if (numSlots < 1 || numSlots > maxReferenceSlots) {
+                printUsage();
+                return 1;
+            }
+            options.videoFlags |= numSlots << VIDEO_REFERENCE_SLOTS_SHIFT;
+        } else if (arg == "--ref-tolerance" && i + 1 < argc) {
+            int tolerance = atoi(argv[++i]);
+            if (tolerance < 0) {
+                printUsage();
+                return 1;
+            }
+            options.referenceTolerance = tolerance;
+        } else if (arg == "--tile-order" && i + 1 < argc) {
+            std::string order = argv[++i];
+            if (order == "raster") {
+                options.tileOrder = TILE_ORDER_RASTER;
+            } else if (order == "chain") {
+                options.tileOrder = TILE_ORDER_CHAIN;
+            } else if (order == "stable") {
+                options.tileOrder = TILE_ORDER_STABLE;
+            } else {
+                printUsage();
+                return 1;
+            }
+        } else if (arg == "--vram") {
+            options.vramSafe = 1;
+        } else if (arg == "--verify") {
+            verify = true;
+        } else if (arg == "--queue-stats") {
+            queueStats = true;
+        } else {
+            printUsage();
+            return 1;
+        }
+    }
 
-    // Counts the frames
-    unsigned int frameNum;
+    // Frames that go straight into VRAM can't refer to the previous frame, since the DS only decompresses them right before they are shown
+    if (options.vramSafe && (options.dictionary || options.residual || options.split || options.bilevel || options.use4bpp ||
+                             options.scroll || options.gridPhase || options.metatiles || referenceSlots(options.videoFlags))) {
+        std::cout << "Error: --vram can't be combined with --dict, --residual, --split, --bilevel, --4bpp, --scroll, --grid-phase, --metatiles "
+                     "or --references" << std::endl;
+        return 1;
+    }
 
-    frameNum = 0;
-    uint8_t* img;
+    if (!inputPath.empty() && !rawPath.empty()) {
+        std::cout << "Error: --input can't be combined with --raw" << std::endl;
+        return 1;
+    }
 
-    std::vector<uint8_t> videoData;
-    // Header of my video format
-    videoData.push_back(0);
-    videoData.push_back(0);
-    videoData.push_back(0);
-    videoData.push_back(0);
+    int numPlanes = (options.videoFlags & VIDEO_FLAG_DUAL_SCREEN) ? 2 : 1;
 
-    memset(bufferImg, 0, imgWidth * imgHeight);
+    // Audio blocks always last ticksPerAudioBlock VBlanks, so the rate gets rounded to a whole number of samples per block
+    int blockSamples = static_cast<int>(std::lround(static_cast<double>(outputRate) * ticksPerAudioBlock / displayRate));
+    if (blockSamples != sampleSize) {
+        options.videoFlags |= blockSamples << VIDEO_AUDIO_BLOCK_SHIFT;
+    }
 
-    std::ifstream audioFile("audio.raw", std::ios::binary);
+    // .y4m files can be read directly, everything else gets decoded by ffmpeg
+    std::string extension = std::filesystem::path(inputPath).extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    bool useFfmpeg = !inputPath.empty() && extension != ".y4m";
+
+    std::unique_ptr<FrameSource> source;
+    if (!rawPath.empty()) {
+        source = std::make_unique<RawFileSource>(rawPath, rawWidth ? rawWidth : imgWidth, rawWidth ? rawHeight : imgHeight * numPlanes, rawChannels);
+    } else if (useFfmpeg) {
+        source = std::make_unique<FfmpegSource>(ffmpegPath, inputPath);
+    } else if (!inputPath.empty()) {
+        source = std::make_unique<Y4mFileSource>(inputPath);
+    } else {
+        source = std::make_unique<PngDirectorySource>("imgs");
+    }
 
-    if (!audioFile) {
-        printf("Error: Couldn't open audio.raw\n");
+    if (!source->open()) {
+        std::cout << "Error: " << source->getError() << std::endl;
         return 1;
     }
 
-    // Audio buffers used for unpacking one stereo track into 2 mono tracks
-    char aBufferL[sampleSize * 2];
-    char aBufferR[sampleSize * 2];
+    // Sources that know their frame rate use it
+    if (source->getFpsNum()) {
+        options.fpsNum = source->getFpsNum();
+        options.fpsDen = source->getFpsDen();
+    }
 
-    size_t audioLen = std::filesystem::file_size("audio.raw");
-    size_t audioOff = 0;
+    if (!timestampPath.empty() && source->getNumFrames() == unknownNumFrames) {
+        std::cout << "Error: --timestamps needs the number of frames up front, which ffmpeg doesn't tell" << std::endl;
+        return 1;
+    }
 
-    // Preloads 12 audio blocks
-    for (int i = 0; i < 12; i++) {
-        for (int j = 0; j < sampleSize; j++) {
-            // If there's still audio to be read read it. Otherwise fill the buffers with 0s
-            if (audioOff < audioLen) {
-                audioFile.read(&aBufferL[j * 2], 2);
-                audioFile.read(&aBufferR[j * 2], 2);
-            } else {
-                aBufferL[j * 2] = 0;
-                aBufferR[j * 2] = 0;
-                aBufferL[j * 2 + 1] = 0;
-                aBufferR[j * 2 + 1] = 0;
-            }
-            audioOff += 4;
+    // The audio of an --input video comes from a second ffmpeg while the video gets encoded. The header has to tell if
+    // the whole track is mono before that, so it's only mono if the video has a single channel or --mono is passed
+    AudioFeed audio;
+    FILE* audioPipe = nullptr;
+    if (useFfmpeg && audioPath.empty()) {
+        int channels = probeAudioChannels(ffmpegPath, inputPath);
+        if (channels > 0) {
+            audioPipe = startAudioDecoder(ffmpegPath, inputPath, audioRate(blockSamples));
         }
+        if (channels < 0 || (channels > 0 && !audioPipe)) {
+            std::cout << "Error: Couldn't decode the audio of " << inputPath << " with ffmpeg" << std::endl;
+            return 1;
+        }
+        forceMono = forceMono || channels <= 1;
+    } else if (!loadAudio(audioPath.empty() ? "audio.raw" : audioPath, rawAudioRate, audioRate(blockSamples), audio.samples)) {
+        std::cout << "Error: Couldn't load " << (audioPath.empty() ? "audio.raw" : audioPath) << std::endl;
+        return 1;
+    } else {
+        // A file is already there as a whole, so it's also mono if both channels are (almost) the same everywhere
+        const std::vector<int16_t>& samples = audio.samples;
+        forceMono = forceMono || samples.empty() || isMono(&samples[0], &samples[1], samples.size() / 2, 2);
+    }
+
+    // If the whole track is mono, the DS doesn't need a buffer for the right speaker
+    if (forceMono) {
+        options.videoFlags |= VIDEO_FLAG_MONO;
+    }
 
-        videoData.insert(videoData.end(), &aBufferL[0], &aBufferL[sampleSize * 2]);
-        videoData.insert(videoData.end(), &aBufferR[0], &aBufferR[sampleSize * 2]);
-    }
-
-    for (auto& p : std::filesystem::directory_iterator("imgs")) {
-        if (!(frameNum % 4)) {
-            for (int i = 0; i < sampleSize; i++) {
-                if (audioOff < audioLen) {
-                    audioFile.read(&aBufferL[i * 2], 2);
-                    audioFile.read(&aBufferR[i * 2], 2);
-                } else {
-                    aBufferL[i * 2] = 0;
-                    aBufferR[i * 2] = 0;
-                    aBufferL[i * 2 + 1] = 0;
-                    aBufferR[i * 2 + 1] = 0;
+    // Reads the decoded audio in chunks on its own thread, so both pipes of ffmpeg keep flowing
+    SpscQueue<std::vector<int16_t>> audioQueue("audio -> convert");
+    std::string audioError;
+    std::unique_ptr<PipelineStage> audioReader;
+    if (audioPipe) {
+        audio.chunks = &audioQueue;
+        audioReader = std::make_unique<PipelineStage>(std::vector<PipelineQueue*>{&audioQueue}, [&] {
+            while (true) {
+                std::vector<int16_t> chunk(static_cast<size_t>(blockSamples) * audioChunkBlocks * 2);
+                size_t length = fread(chunk.data(), 4, chunk.size() / 2, audioPipe);
+                if (length == 0) {
+                    break;
                 }
-                audioOff += 4;
+                chunk.resize(length * 2);
+
+                // Once the video is done, the rest of the audio isn't needed, and ffmpeg fails on the closed pipe
+                if (!audioQueue.push(std::move(chunk))) {
+                    closeDecoder(audioPipe);
+                    return;
+                }
+            }
+            if (!closeDecoder(audioPipe)) {
+                audioError = "Couldn't decode the audio of " + inputPath + " with ffmpeg";
             }
+            audioQueue.close();
+        });
+    }
 
-            videoData.insert(videoData.end(), &aBufferL[0], &aBufferL[sampleSize * 2]);
-            videoData.insert(videoData.end(), &aBufferR[0], &aBufferR[sampleSize * 2]);
-        }
+    // Frames are shown for as many VBlanks as they last in the source instead of being duplicated. Without the number of
+    // frames, the constant frame rate gets continued as the frames come in
+    size_t numFrames = source->getNumFrames() == unknownNumFrames ? 0 : source->getNumFrames();
+    std::vector<uint64_t> frameTicks;
+    if (!loadFrameTicks(frameTicks, numFrames, options, timestampPath)) {
+        std::cout << "Error: Couldn't read a valid timestamp for every frame from " << timestampPath << std::endl;
+        return 1;
+    }
 
-        // Load image and divide all values by 8
-        img = stbi_load(p.path().string().c_str(), &width, &height, &bpp, 0);
-        for (int j = 0; j < 256 * 192 * 3; j += 3) {
-            img[j] = img[j] >> 3;
-            img[j + 1] = img[j + 1] >> 3;
-            img[j + 2] = img[j + 2] >> 3;
+    // Continue from the last checkpoint if there is one
+    auto checkpoint = std::make_unique<Checkpoint>();
+    std::fstream output;
+    std::unique_ptr<KpvEncoder> encoder;
+
+    // The encoder appends everything, except for the number of frames at the very end
+    KpvEncoder::Sink sink = [&output](const uint8_t* data, size_t size, uint64_t offset) {
+        output.seekp(static_cast<std::streamoff>(offset));
+        output.write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(size));
+        return static_cast<bool>(output);
+    };
+
+    if (loadCheckpoint(*checkpoint)) {
+        if (!(checkpoint->options == options)) {
+            std::cout << "Error: The checkpoint was made with different options" << std::endl;
+            return 1;
         }
 
-        compressFrame(img, imgData, bufferImg, flags, imgDataSize);
+        // Throw away everything that got written after the checkpoint
+        std::filesystem::resize_file(outputPath, checkpoint->state.outputBytes);
+        output.open(outputPath, std::ios::binary | std::ios::in | std::ios::out);
+        encoder = std::make_unique<KpvEncoder>(options, sink, &checkpoint->state);
+
+        std::cout << "Resuming from frame " << checkpoint->state.sourceFrame << std::endl;
+
+        // Skipping frames doesn't load them, except from ffmpeg
+        for (uint32_t i = 0; i < checkpoint->state.sourceFrame; i++) {
+            if (!source->nextFrame()) {
+                std::cout << "Error: The source is shorter than the checkpoint" << std::endl;
+                return 1;
+            }
+            if (frameTicks.size() < i + 2) {
+                frameTicks.push_back(constantFrameTick(i + 1, options));
+            }
+        }
 
-        videoData.push_back(flags);
-        if (flags != FLAG_COMPRESSION_STAY) {
-            videoData.push_back(imgDataSize & 0xFF);
-            videoData.push_back((imgDataSize >> 8) & 0xFF);
-            videoData.insert(videoData.end(), imgData, imgData + imgDataSize);
-            free(imgData);  // Clean up memory used by CUE's LZSS function
+        // The decoder doesn't know what was on screen before the checkpoint
+        if (verify) {
+            std::cout << "Frames can't be verified when resuming" << std::endl;
+            verify = false;
         }
+    } else {
+        output.open(outputPath, std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc);
+        encoder = std::make_unique<KpvEncoder>(options, sink);
+    }
 
-        frameNum++;
+    if (!output) {
+        std::cout << "Error: Couldn't open output file" << std::endl;
+        return 1;
+    }
 
-        if ((frameNum % 1000) == 0) {
-            std::cout << frameNum << std::endl;
+    // The encoder holds every frame back until the audio in front of it is there, so the audio gets pushed right after it
+    encoder->setVerify(verify);
+    if (audio.chunks) {
+        audio.skip = encoder->getState().audioOff;
+    } else {
+        audio.pos = std::min<uint64_t>(encoder->getState().audioOff, audio.samples.size() / 2);
+    }
+    if (!pushMissingAudio(*encoder, audio)) {
+        std::cout << "Error: " << encoder->getError() << std::endl;
+        return 1;
+    }
+
+    // Reading and decoding the images run on their own threads, just like the stages of the encoder. This thread converts
+    // them and feeds the audio in
+    SpscQueue<SourceFrame> readQueue("read -> decode");
+    SpscQueue<SourceFrame> decodeQueue("decode -> convert");
+    std::string decodeError;
+    size_t firstFrame = encoder->getState().sourceFrame;
+
+    PipelineStage reader({&readQueue, &decodeQueue}, [&] {
+        for (size_t i = firstFrame; source->nextFrame(); i++) {
+            if (frameTicks.size() < i + 2) {
+                frameTicks.push_back(constantFrameTick(i + 1, options));
+            }
+
+            // Frames that would be replaced before they are shown can be skipped entirely, so they don't get loaded
+            SourceFrame frame;
+            frame.duration = frameTicks[i + 1] - frameTicks[i];
+            if (frame.duration != 0 && !source->readImage(frame.image)) {
+                break;
+            }
+            if (!readQueue.push(std::move(frame))) {
+                return;
+            }
+        }
+        readQueue.close();
+    });
+
+    PipelineStage decoder({&readQueue, &decodeQueue}, [&] {
+        SourceFrame frame;
+        while (readQueue.pop(frame)) {
+            if (frame.duration != 0 && !source->decodeImage(frame.image, decodeError)) {
+                readQueue.stop();
+                break;
+            }
+            if (!decodeQueue.push(std::move(frame))) {
+                return;
+            }
+        }
+        decodeQueue.close();
+    });
+
+    SourceFrame frame;
+    while (decodeQueue.pop(frame)) {
+        const SourceImage& image = frame.image;
+        size_t stride = static_cast<size_t>(image.width) * image.channels;
+        if (!encoder->pushFrame(image.pixels, image.width, image.height, stride, image.channels, frame.duration) ||
+            !pushMissingAudio(*encoder, audio)) {
+            std::cout << "Error: " << encoder->getError() << std::endl;
+            return 1;
+        }
+
+        uint32_t sourceFrame = encoder->getState().sourceFrame;
+        if ((sourceFrame % 1000) == 0) {
+            std::cout << sourceFrame << std::endl;
         }
 
-        stbi_image_free(img);
+        // Save a checkpoint once everything up to here is on disk
+        if ((sourceFrame % checkpointInterval) == 0) {
+            if (!encoder->drain()) {
+                std::cout << "Error: " << encoder->getError() << std::endl;
+                return 1;
+            }
+            if (!encoder->isIdle()) {
+                continue;
+            }
+            output.flush();
+
+            checkpoint->options = options;
+            checkpoint->state = encoder->getState();
+
+            if (!output || !saveCheckpoint(*checkpoint)) {
+                std::cout << "Error: Couldn't write checkpoint" << std::endl;
+                return 1;
+            }
+        }
     }
     std::cout << std::endl;
+    reader.join();
+    decoder.join();
 
-    // Write the number of frames into the file header
-    memcpy(videoData.data(), &frameNum, 4);
-
-    std::ofstream output("BadApple.kpv", std::ios::binary);
+    // Audio after the end of the video isn't needed, so the audio decoder only gets checked if it was done by now
+    if (audioReader) {
+        audioQueue.stop();
+        audioReader->join();
+    }
+    if (!audioError.empty()) {
+        std::cout << "Error: " << audioError << std::endl;
+        return 1;
+    }
 
-    if (!output) {
-        std::cout << "Error: Couldn't open output file" << std::endl;
+    // A source that ended because it's broken
+    if (!decodeError.empty()) {
+        std::cout << "Error: " << decodeError << std::endl;
+        return 1;
+    }
+    if (!source->getError().empty() || !source->close()) {
+        std::cout << "Error: " << source->getError() << std::endl;
         return 1;
     }
 
-    output.write(reinterpret_cast<char*>(videoData.data()), static_cast<long long int>(videoData.size()));
+    // Writes the frames that are left and the number of frames into the file header
+    bool finished = encoder->finish();
     output.close();
 
+    if (!finished || !output) {
+        std::cout << "Error: " << (finished ? "Couldn't write output file" : encoder->getError()) << std::endl;
+        return 1;
+    }
+
+    const EncoderState& state = encoder->getState();
+    if (options.lz11 || options.dictionary || options.residual || options.split || options.bilevel || options.use4bpp || options.scroll || options.gridPhase ||
+        options.metatiles || referenceSlots(options.videoFlags)) {
+        std::cout << state.lz11Frames << " frames use LZ11, " << state.dictFrames << " frames use the previous frame as dictionary, "
+                  << state.residualFrames << " frames are XORed with the previous frame, " << state.splitFrames << " frames are split, "
+                  << state.bilevelFrames << " frames have packed two-tone characters, " << state.frames4bpp << " frames are 4bpp, "
+                  << state.scrollFrames << " frames are scrolled, " << state.metatileFrames << " frames use metatiles, "
+                  << state.referenceFrames << " frames are shown from a reference slot, "
+                  << state.imgDataBytes << " bytes instead of " << state.lz10Bytes << " bytes with LZ10 only" << std::endl;
+    }
+
+    // A queue that's mostly full waits for the stage behind it, and one that's mostly empty for the stage in front of it
+    if (queueStats) {
+        std::vector<QueueStats> stats = {readQueue.getStats(), decodeQueue.getStats()};
+        if (audioReader) {
+            stats.push_back(audioQueue.getStats());
+        }
+        std::vector<QueueStats> encoderStats = encoder->getQueueStats();
+        stats.insert(stats.end(), encoderStats.begin(), encoderStats.end());
+        for (auto& queue : stats) {
+            std::cout << queue.name << ": " << queue.averageOccupancy << " of " << queue.capacity << " items on average (max "
+                      << queue.maxOccupancy << "), " << queue.fullSeconds << " s waiting while full, " << queue.emptySeconds
+                      << " s waiting while empty" << std::endl;
+        }
+    }
+
+    // The video is complete, so the checkpoint isn't needed anymore
+    std::filesystem::remove(checkpointPath);
+
     return 0;
 }
@@ -0,0 +1,65 @@
+#include <chrono>
+
+#include "pipeline.h"
+
+void PipelineQueue::close() {
+    closed = true;
+    std::lock_guard<std::mutex> lock(mutex);
+    condition.notify_all();
+}
+
+void PipelineQueue::stop() {
+    stopped = true;
+    std::lock_guard<std::mutex> lock(mutex);
+    condition.notify_all();
+}
+
+QueueStats PipelineQueue::getStats() const {
+    uint64_t numItems = items;
+    return {name, capacity, numItems, numItems ? static_cast<double>(occupancySum) / numItems : 0.0, maxOccupancy,
+            fullTime / 1e9, emptyTime / 1e9};
+}
+
+void PipelineQueue::wait(bool full, const std::function<bool()>& ready) {
+    auto start = std::chrono::steady_clock::now();
+    {
+        // The other side checks waiting right after moving its index, so either it sees the waiting counter or ready
+        // sees the new index
+        std::unique_lock<std::mutex> lock(mutex);
+        waiting++;
+        condition.wait(lock, [&] { return stopped || ready(); });
+        waiting--;
+    }
+    auto time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    (full ? fullTime : emptyTime) += static_cast<uint64_t>(time);
+}
+
+void PipelineQueue::wake() {
+    if (waiting) {
+        std::lock_guard<std::mutex> lock(mutex);
+        condition.notify_all();
+    }
+}
+
+void PipelineQueue::countPush(size_t occupancy) {
+    items++;
+    occupancySum += occupancy;
+    if (occupancy > maxOccupancy) {
+        maxOccupancy = occupancy;
+    }
+}
+
+PipelineStage::~PipelineStage() {
+    if (thread.joinable()) {
+        for (PipelineQueue* queue : queues) {
+            queue->stop();
+        }
+        thread.join();
+    }
+}
+
+void PipelineStage::join() {
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
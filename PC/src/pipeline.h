@@ -0,0 +1,136 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Bounded queues between the stages of the encoder, which all run on their own threads
+
+constexpr size_t pipelineQueueSize = 4;     // Items that can wait between two stages
+
+// How a queue got used, to find the stage that holds up the others. A queue that's full most of the time is waiting for
+// the stage behind it, and one that's empty most of the time is waiting for the stage in front of it
+struct QueueStats {
+    const char* name;
+    size_t capacity;
+    uint64_t items;             // Items that went through
+    double averageOccupancy;    // Items in the queue right after a push, on average
+    size_t maxOccupancy;
+    double fullSeconds;         // Time the producer spent waiting for a free slot
+    double emptySeconds;        // Time the consumer spent waiting for an item
+};
+
+// Everything about a queue that doesn't depend on its items
+class PipelineQueue {
+public:
+    PipelineQueue(const char* name, size_t capacity) : name(name), capacity(capacity) {}
+    PipelineQueue(const PipelineQueue&) = delete;
+    PipelineQueue& operator=(const PipelineQueue&) = delete;
+
+    // Called by the producer once it's done. The consumer still gets everything that's left
+    void close();
+
+    // Something went wrong, so both sides stop waiting and give up
+    void stop();
+
+    bool isStopped() const {
+        return stopped;
+    }
+
+    QueueStats getStats() const;
+
+protected:
+    // Blocks until ready returns true or the queue gets stopped. full tells if it's the producer that waits
+    void wait(bool full, const std::function<bool()>& ready);
+
+    // Wakes up the other side if it's waiting
+    void wake();
+
+    // Keeps track of the occupancy after every push
+    void countPush(size_t occupancy);
+
+    const char* name;
+    size_t capacity;
+    std::atomic<size_t> head{0};    // Number of items that have been popped, only written by the consumer
+    std::atomic<size_t> tail{0};    // Number of items that have been pushed, only written by the producer
+    std::atomic<bool> closed{false};
+    std::atomic<bool> stopped{false};
+
+private:
+    // Only used when one side has to wait. Pushing and popping don't take a lock otherwise
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::atomic<int> waiting{0};
+
+    std::atomic<uint64_t> items{0};
+    std::atomic<uint64_t> occupancySum{0};
+    std::atomic<size_t> maxOccupancy{0};
+    std::atomic<uint64_t> fullTime{0};      // Nanoseconds
+    std::atomic<uint64_t> emptyTime{0};
+};
+
+// A bounded lock free ring buffer with a single producer and a single consumer. Pushing waits while it's full, so a slow
+// stage holds up the ones in front of it instead of letting items pile up in memory
+template<typename T>
+class SpscQueue : public PipelineQueue {
+public:
+    explicit SpscQueue(const char* name, size_t capacity = pipelineQueueSize) : PipelineQueue(name, capacity), slots(capacity) {}
+
+    // Returns false if the queue got stopped
+    bool push(T&& item) {
+        size_t index = tail.load(std::memory_order_relaxed);
+        if (index - head.load() == capacity) {
+            wait(true, [&] { return index - head.load() < capacity; });
+        }
+        if (stopped) {
+            return false;
+        }
+
+        slots[index % capacity] = std::move(item);
+        tail.store(index + 1);
+        countPush(index + 1 - head.load());
+        wake();
+        return true;
+    }
+
+    // Returns false once the queue is closed and empty, or if it got stopped
+    bool pop(T& item) {
+        size_t index = head.load(std::memory_order_relaxed);
+        if (tail.load() == index) {
+            wait(false, [&] { return tail.load() != index || closed; });
+        }
+        if (stopped || tail.load() == index) {
+            return false;
+        }
+
+        item = std::move(slots[index % capacity]);
+        head.store(index + 1);
+        wake();
+        return true;
+    }
+
+private:
+    std::vector<T> slots;
+};
+
+// Runs a stage on its own thread. If the stage is still running when it gets destroyed (because the encode ended early),
+// its queues get stopped first, so it can't wait forever
+class PipelineStage {
+public:
+    PipelineStage(std::vector<PipelineQueue*> queues, std::function<void()> run) : queues(std::move(queues)), thread(std::move(run)) {}
+    PipelineStage(const PipelineStage&) = delete;
+    PipelineStage& operator=(const PipelineStage&) = delete;
+    ~PipelineStage();
+
+    // Waits until the stage is done
+    void join();
+
+private:
+    std::vector<PipelineQueue*> queues;
+    std::thread thread;
+};
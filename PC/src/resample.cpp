@@ -0,0 +1,94 @@
+#include <cmath>
+#include <numbers>
+#include <numeric>
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "resample.h"
+
+constexpr int filterTaps = 32;          // Input samples that go into every output sample
+constexpr double filterCutoff = 0.85;   // Cutoff relative to the lower Nyquist frequency, which leaves room for the transition band
+constexpr double kaiserBeta = 8.0;      // Shape of the Kaiser window, about 80 dB of stopband attenuation
+
+// Zeroth order modified Bessel function of the first kind, used by the Kaiser window
+static double besselI0(double x) {
+    double sum = 1, term = 1;
+    for (int k = 1; k < 32; k++) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+// Dot product of a filter phase with filterTaps input samples
+static float convolve(const float* coefficients, const float* samples) {
+#ifdef __SSE2__
+    __m128 sum = _mm_setzero_ps();
+    for (int i = 0; i < filterTaps; i += 4) {
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(&coefficients[i]), _mm_loadu_ps(&samples[i])));
+    }
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+    return _mm_cvtss_f32(sum);
+#else
+    float sum = 0;
+    for (int i = 0; i < filterTaps; i++) {
+        sum += coefficients[i] * samples[i];
+    }
+    return sum;
+#endif
+}
+
+std::vector<int16_t> resample(const std::vector<int16_t>& input, int numChannels, int inRate, int outRate) {
+    if (inRate == outRate) {
+        return input;
+    }
+
+    // Output sample n is at input position n * down / up, so there are up different phases
+    int divisor = std::gcd(inRate, outRate);
+    int up = outRate / divisor;
+    int down = inRate / divisor;
+
+    // Every phase gets its own set of coefficients, each one normalized so a constant signal stays the same
+    double cutoff = filterCutoff * std::min(1.0, static_cast<double>(outRate) / inRate);
+    std::vector<float> filter(static_cast<size_t>(up) * filterTaps);
+    for (int phase = 0; phase < up; phase++) {
+        double offset = static_cast<double>(phase) / up;
+        double sum = 0;
+        for (int i = 0; i < filterTaps; i++) {
+            double x = i - (filterTaps / 2 - 1) - offset;
+            double sinc = x == 0 ? 1 : std::sin(std::numbers::pi * cutoff * x) / (std::numbers::pi * cutoff * x);
+            double window = x / (filterTaps / 2);
+            window = std::abs(window) < 1 ? besselI0(kaiserBeta * std::sqrt(1 - window * window)) / besselI0(kaiserBeta) : 0;
+            filter[phase * filterTaps + i] = static_cast<float>(sinc * window);
+            sum += sinc * window;
+        }
+        for (int i = 0; i < filterTaps; i++) {
+            filter[phase * filterTaps + i] = static_cast<float>(filter[phase * filterTaps + i] / sum);
+        }
+    }
+
+    size_t inSamples = input.size() / numChannels;
+    size_t outSamples = inSamples * up / down;
+    std::vector<int16_t> output(outSamples * numChannels);
+
+    // Every channel gets padded with silence, so the filter never reads outside of it
+    std::vector<float> channel(inSamples + filterTaps * 2);
+    for (int c = 0; c < numChannels; c++) {
+        for (size_t i = 0; i < inSamples; i++) {
+            channel[filterTaps + i] = input[i * numChannels + c];
+        }
+
+        for (size_t n = 0; n < outSamples; n++) {
+            uint64_t position = static_cast<uint64_t>(n) * down;
+            size_t index = position / up;
+            int phase = static_cast<int>(position % up);
+            float sample = convolve(&filter[phase * filterTaps], &channel[filterTaps + index - (filterTaps / 2 - 1)]);
+            output[n * numChannels + c] = static_cast<int16_t>(std::clamp(std::lround(sample), -32768L, 32767L));
+        }
+    }
+    return output;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// Polyphase resampler for 16 bit audio
+
+// Converts interleaved samples with numChannels channels from inRate to outRate. Every output sample gets calculated
+// from the closest input samples with a windowed sinc filter, which also cuts everything above the lower Nyquist
+// frequency, so downsampling doesn't alias
+std::vector<int16_t> resample(const std::vector<int16_t>& input, int numChannels, int inRate, int outRate);
@@ -0,0 +1,179 @@
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "scale.h"
+
+// Output pixels that get scaled side by side, one per SSE lane
+constexpr int lanes = 4;
+
+// Weights of the source pixels that make up every output pixel along one axis. Output pixel i covers the source pixels
+// from start[i] on, with taps weights each. Weights past the end of the source are 0. The weights of every group of
+// lanes output pixels are stored tap by tap, so one load gets the same tap of the whole group. The last group is padded
+// with pixels that have no weights
+struct AreaWeights {
+    int taps;
+    std::vector<int> start;
+    std::vector<float> weights;
+
+    float& weight(int i, int j) {
+        return weights[(static_cast<size_t>(i / lanes) * taps + j) * lanes + i % lanes];
+    }
+};
+
+// How much of source pixel j lies inside [begin, end)
+static double coverage(int j, double begin, double end) {
+    return std::max(0.0, std::min(end, j + 1.0) - std::max(begin, static_cast<double>(j)));
+}
+
+static AreaWeights areaWeights(int srcSize, int dstSize) {
+    AreaWeights area;
+    double scale = static_cast<double>(srcSize) / dstSize;
+    area.taps = static_cast<int>(std::ceil(scale)) + 1;
+    int padded = (dstSize + lanes - 1) / lanes * lanes;
+    area.start.resize(padded);
+    area.weights.resize(static_cast<size_t>(padded) * area.taps);
+
+    for (int i = 0; i < dstSize; i++) {
+        double begin = i * scale;
+        double end = (i + 1) * scale;
+        area.start[i] = static_cast<int>(begin);
+        for (int j = 0; j < area.taps; j++) {
+            int pixel = area.start[i] + j;
+            area.weight(i, j) = pixel < srcSize ? static_cast<float>(coverage(pixel, begin, end) / scale) : 0;
+        }
+    }
+    return area;
+}
+
+// Adds a row multiplied by weight to an output row
+static void accumulateRow(float* dst, const float* src, float weight, int width) {
+    int x = 0;
+#ifdef __SSE2__
+    __m128 w = _mm_set1_ps(weight);
+    for (; x + 4 <= width; x += 4) {
+        _mm_storeu_ps(&dst[x], _mm_add_ps(_mm_loadu_ps(&dst[x]), _mm_mul_ps(_mm_loadu_ps(&src[x]), w)));
+    }
+#endif
+    for (; x < width; x++) {
+        dst[x] += src[x] * weight;
+    }
+}
+
+// Converts a row of grayscale pixels to brightness
+static void grayRow(float* dst, const uint8_t* pixel, int width) {
+    int x = 0;
+#ifdef __SSE2__
+    __m128i zero = _mm_setzero_si128();
+    for (; x + 16 <= width; x += 16) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&pixel[x]));
+        __m128i low = _mm_unpacklo_epi8(bytes, zero);
+        __m128i high = _mm_unpackhi_epi8(bytes, zero);
+        _mm_storeu_ps(&dst[x], _mm_cvtepi32_ps(_mm_unpacklo_epi16(low, zero)));
+        _mm_storeu_ps(&dst[x + 4], _mm_cvtepi32_ps(_mm_unpackhi_epi16(low, zero)));
+        _mm_storeu_ps(&dst[x + 8], _mm_cvtepi32_ps(_mm_unpacklo_epi16(high, zero)));
+        _mm_storeu_ps(&dst[x + 12], _mm_cvtepi32_ps(_mm_unpackhi_epi16(high, zero)));
+    }
+#endif
+    for (; x < width; x++) {
+        dst[x] = pixel[x];
+    }
+}
+
+// Converts a row of RGB pixels to brightness
+static void lumaRow(float* dst, const uint8_t* pixel, int width) {
+    int x = 0;
+#ifdef __SSE2__
+    // Every product and sum is a whole number below 2^24, so the floats add up to exactly the integer sum of the scalar
+    // version in any order. 4 pixels take 12 bytes, but 16 get loaded, so the last pixels of the row are left to the
+    // scalar loop
+    __m128i zero = _mm_setzero_si128();
+    __m128 redWeight = _mm_set1_ps(2126), greenWeight = _mm_set1_ps(7152), blueWeight = _mm_set1_ps(722);
+    for (; x * 3 + 16 <= width * 3; x += 4) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&pixel[x * 3]));
+        __m128i low = _mm_unpacklo_epi8(bytes, zero);
+        __m128i high = _mm_unpackhi_epi8(bytes, zero);
+        // r0 g0 b0 r1, g1 b1 r2 g2, b2 r3 g3 b3
+        __m128 first = _mm_cvtepi32_ps(_mm_unpacklo_epi16(low, zero));
+        __m128 second = _mm_cvtepi32_ps(_mm_unpackhi_epi16(low, zero));
+        __m128 third = _mm_cvtepi32_ps(_mm_unpacklo_epi16(high, zero));
+        __m128 red = _mm_shuffle_ps(first, _mm_shuffle_ps(second, third, _MM_SHUFFLE(1, 1, 2, 2)), _MM_SHUFFLE(2, 0, 3, 0));
+        __m128 green = _mm_shuffle_ps(_mm_shuffle_ps(first, second, _MM_SHUFFLE(0, 0, 1, 1)), _mm_shuffle_ps(second, third, _MM_SHUFFLE(2, 2, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0));
+        __m128 blue = _mm_shuffle_ps(_mm_shuffle_ps(first, second, _MM_SHUFFLE(1, 1, 2, 2)), third, _MM_SHUFFLE(3, 0, 2, 0));
+        __m128 sum = _mm_add_ps(_mm_add_ps(_mm_mul_ps(red, redWeight), _mm_mul_ps(green, greenWeight)), _mm_mul_ps(blue, blueWeight));
+        _mm_storeu_ps(&dst[x], _mm_mul_ps(sum, _mm_set1_ps(1e-4f)));
+    }
+#endif
+    for (; x < width; x++) {
+        dst[x] = static_cast<float>(2126 * pixel[x * 3] + 7152 * pixel[x * 3 + 1] + 722 * pixel[x * 3 + 2]) * 1e-4f;
+    }
+}
+
+// Scales a row of brightness horizontally. The taps of every output pixel get added in order, so the SSE2 version,
+// which works on lanes output pixels at once, gives the same sums as the scalar one
+static void scaleRow(float* dst, const float* brightness, AreaWeights& columns) {
+    int width = static_cast<int>(columns.start.size());
+    for (int x = 0; x < width; x += lanes) {
+        const float* weights = &columns.weight(x, 0);
+        const float* src[lanes];
+        for (int lane = 0; lane < lanes; lane++) {
+            src[lane] = &brightness[columns.start[x + lane]];
+        }
+#ifdef __SSE2__
+        __m128 sum = _mm_setzero_ps();
+        for (int j = 0; j < columns.taps; j++) {
+            __m128 taps = _mm_setr_ps(src[0][j], src[1][j], src[2][j], src[3][j]);
+            sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(&weights[j * lanes]), taps));
+        }
+        _mm_storeu_ps(&dst[x], sum);
+#else
+        for (int lane = 0; lane < lanes; lane++) {
+            float sum = 0;
+            for (int j = 0; j < columns.taps; j++) {
+                sum += weights[j * lanes + lane] * src[lane][j];
+            }
+            dst[x + lane] = sum;
+        }
+#endif
+    }
+}
+
+void scaleToLevels(const uint8_t* pixels, int channels, int srcWidth, int srcHeight, size_t stride, uint8_t* dst, int dstWidth, int dstHeight) {
+    AreaWeights columns = areaWeights(srcWidth, dstWidth);
+    double rowScale = static_cast<double>(srcHeight) / dstHeight;
+
+    // The brightness of a source row gets padded with 0s, so the last taps never read past it
+    std::vector<float> brightness(srcWidth + columns.taps);
+    std::vector<float> scaledRow(columns.start.size());
+    std::vector<float> sums(static_cast<size_t>(dstWidth) * dstHeight);
+
+    // Every source row gets converted and scaled horizontally once, and then added to every output row it overlaps
+    for (int y = 0; y < srcHeight; y++) {
+        const uint8_t* pixel = &pixels[y * stride];
+        if (channels == 1) {
+            grayRow(brightness.data(), pixel, srcWidth);
+        } else {
+            lumaRow(brightness.data(), pixel, srcWidth);
+        }
+        scaleRow(scaledRow.data(), brightness.data(), columns);
+
+        int first = static_cast<int>(y / rowScale);
+        int last = std::min(dstHeight - 1, static_cast<int>(std::ceil((y + 1) / rowScale)) - 1);
+        for (int row = first; row <= last; row++) {
+            double weight = coverage(y, row * rowScale, (row + 1) * rowScale) / rowScale;
+            if (weight > 0) {
+                accumulateRow(&sums[static_cast<size_t>(row) * dstWidth], scaledRow.data(), static_cast<float>(weight), dstWidth);
+            }
+        }
+    }
+
+    // Brightness levels are the 8 bit values divided by 8. The small offset keeps rounding errors from pushing a flat
+    // area below its level
+    for (size_t i = 0; i < sums.size(); i++) {
+        dst[i] = static_cast<uint8_t>(std::min(31, static_cast<int>(sums[i] / 8 + 1e-3f)));
+    }
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+// Area filter for source images that are bigger than the DS screens
+
+// Scales an RGB (3 channels) or grayscale (1 channel) image down to dstWidth x dstHeight and converts it to brightness
+// levels (0-31) in the same pass. Every output pixel is the average brightness of the part of the source image it covers,
+// so nothing gets skipped or aliased. Rows of the source image start stride bytes apart
+void scaleToLevels(const uint8_t* pixels, int channels, int srcWidth, int srcHeight, size_t stride, uint8_t* dst, int dstWidth, int dstHeight);
@@ -0,0 +1,73 @@
+#include <cstring>
+#include <algorithm>
+
+#include "y4m.h"
+
+bool parseY4mHeader(const std::string& header, Y4mFormat& format, std::string& error) {
+    if (header.compare(0, 10, "YUV4MPEG2 ") != 0) {
+        error = "Not a YUV4MPEG2 stream";
+        return false;
+    }
+
+    // Every parameter is a letter followed by its value, separated by spaces. Streams without C are 4:2:0
+    format = Y4mFormat();
+    std::string colorspace = "420";
+    bool hasRange = false;
+    for (size_t pos = 10; pos < header.size();) {
+        size_t end = std::min(header.find(' ', pos), header.size());
+        std::string param = header.substr(pos, end - pos);
+        pos = end + 1;
+
+        if (param.empty()) {
+            continue;
+        } else if (param[0] == 'W') {
+            format.width = atoi(&param[1]);
+        } else if (param[0] == 'H') {
+            format.height = atoi(&param[1]);
+        } else if (param[0] == 'F') {
+            sscanf(&param[1], "%u:%u", &format.fpsNum, &format.fpsDen);
+        } else if (param[0] == 'C') {
+            colorspace = param.substr(1);
+        } else if (param == "XCOLORRANGE=LIMITED" || param == "XCOLORRANGE=FULL") {
+            format.limitedRange = param == "XCOLORRANGE=LIMITED";
+            hasRange = true;
+        }
+    }
+
+    if (format.width <= 0 || format.height <= 0 || !format.fpsNum || !format.fpsDen) {
+        error = "Invalid YUV4MPEG2 header";
+        return false;
+    }
+
+    // Only 8 bit samples. The chroma planes get skipped
+    size_t chromaWidth = (format.width + 1) / 2;
+    size_t chromaHeight = (format.height + 1) / 2;
+    if (colorspace == "mono") {
+        format.chromaSize = 0;
+    } else if (colorspace == "420" || colorspace == "420jpeg" || colorspace == "420paldv" || colorspace == "420mpeg2") {
+        format.chromaSize = chromaWidth * chromaHeight * 2;
+    } else if (colorspace == "422") {
+        format.chromaSize = chromaWidth * format.height * 2;
+    } else if (colorspace == "444") {
+        format.chromaSize = format.lumaSize() * 2;
+    } else {
+        error = "Unsupported YUV4MPEG2 colorspace " + colorspace;
+        return false;
+    }
+
+    // Grayscale streams are full range unless they say otherwise, YUV streams are limited range
+    if (!hasRange) {
+        format.limitedRange = colorspace != "mono";
+    }
+    return true;
+}
+
+bool isY4mFrameHeader(const char* line, size_t length) {
+    return length >= 5 && memcmp(line, "FRAME", 5) == 0;
+}
+
+void expandLumaRange(const uint8_t* src, uint8_t* dst, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        dst[i] = static_cast<uint8_t>((std::clamp<int>(src[i], 16, 235) - 16) * 255 / 219);
+    }
+}
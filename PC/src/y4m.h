@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+// Layout of a YUV4MPEG2 stream, like the ones ffmpeg writes with -f yuv4mpegpipe. Every frame is a line starting with
+// FRAME, followed by the luma plane and the chroma planes. Only the luma plane gets used, since that's all the DS shows
+struct Y4mFormat {
+    int width = 0;
+    int height = 0;
+    uint32_t fpsNum = 0;        // Frame rate as a fraction
+    uint32_t fpsDen = 0;
+    size_t chromaSize = 0;      // Bytes of the chroma planes that follow the luma plane
+    bool limitedRange = false;  // Luma goes from 16 to 235 instead of 0 to 255
+
+    size_t lumaSize() const {
+        return static_cast<size_t>(width) * height;
+    }
+};
+
+// Parses the header line of a stream (without the line break). Returns false and sets error if it can't be used
+bool parseY4mHeader(const std::string& header, Y4mFormat& format, std::string& error);
+
+// Checks if a line (without the line break) starts a frame
+bool isY4mFrameHeader(const char* line, size_t length);
+
+// Copies a limited range luma plane and stretches it to full range on the way
+void expandLumaRange(const uint8_t* src, uint8_t* dst, size_t size);